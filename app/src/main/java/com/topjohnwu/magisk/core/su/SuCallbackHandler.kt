@@ -22,6 +22,11 @@ import com.topjohnwu.superuser.Shell
 import kotlinx.coroutines.GlobalScope
 import kotlinx.coroutines.launch
 import timber.log.Timber
+import java.io.DataInputStream
+import java.io.EOFException
+import java.io.FileInputStream
+import java.io.IOException
+import kotlin.concurrent.thread
 
 object SuCallbackHandler {
 
@@ -29,6 +34,7 @@ object SuCallbackHandler {
     const val LOG = "log"
     const val NOTIFY = "notify"
     const val TEST = "test"
+    const val CHANNEL = "channel"
 
     operator fun invoke(context: Context, action: String?, data: Bundle?) {
         data ?: return
@@ -47,6 +53,7 @@ object SuCallbackHandler {
             REQUEST -> handleRequest(context, data)
             LOG -> handleLogging(context, data)
             NOTIFY -> handleNotify(context, data)
+            CHANNEL -> handleChannel(context, data)
             TEST -> {
                 val mode = data.getInt("mode", 2)
                 Shell.su(
@@ -123,6 +130,50 @@ object SuCallbackHandler {
         }
     }
 
+    // The daemon keeps streaming log and notify events through the fifo
+    // until it closes the channel after being idle
+    private fun handleChannel(context: Context, data: Bundle) {
+        val name = data.getString("fifo") ?: return
+        thread(name = "su-channel") {
+            try {
+                DataInputStream(FileInputStream(name).buffered()).use {
+                    while (true) {
+                        val event = it.readEvent()
+                        when (event.getString("action")) {
+                            LOG -> handleLogging(context, event)
+                            NOTIFY -> handleNotify(context, event)
+                        }
+                    }
+                }
+            } catch (e: EOFException) {
+                // Channel closed by the daemon
+            } catch (e: IOException) {
+                Timber.e(e)
+            }
+        }
+    }
+
+    @Throws(IOException::class)
+    private fun DataInputStream.readEvent(): Bundle {
+        fun readString(): String {
+            val len = readInt()
+            val buf = ByteArray(len)
+            readFully(buf)
+            return String(buf, Charsets.UTF_8)
+        }
+        val bundle = Bundle()
+        while (true) {
+            val name = readString()
+            val value = readString()
+            when (name) {
+                "eof" -> return bundle
+                "action", "command" -> bundle.putString(name, value)
+                "notify" -> bundle.putBoolean(name, value == "1")
+                else -> value.toIntOrNull()?.let { bundle.putInt(name, it) }
+            }
+        }
+    }
+
     private fun notify(context: Context, policy: SuPolicy) {
         if (policy.notification && Config.suNotification == Config.Value.NOTIFICATION_TOAST) {
             val resId = if (policy.policy == SuPolicy.ALLOW)
@@ -25,6 +25,7 @@ LOCAL_SRC_FILES := \
     core/restorecon.cpp \
     core/module.cpp \
     core/logging.cpp \
+    core/trace.cpp \
     magiskhide/magiskhide.cpp \
     magiskhide/hide_utils.cpp \
     magiskhide/hide_policy.cpp \
@@ -58,7 +59,7 @@ include $(CLEAR_VARS)
 ifdef B_INIT
 
 LOCAL_MODULE := magiskinit
-LOCAL_STATIC_LIBRARIES := libsepol libxz libutils
+LOCAL_STATIC_LIBRARIES := libsepol libxz libmincrypt libutils
 LOCAL_C_INCLUDES := jni/include out
 
 LOCAL_SRC_FILES := \
@@ -108,7 +109,7 @@ ifdef B_POLICY
 
 include $(CLEAR_VARS)
 LOCAL_MODULE := magiskpolicy
-LOCAL_STATIC_LIBRARIES := libsepol libutils
+LOCAL_STATIC_LIBRARIES := libsepol libmincrypt libutils
 LOCAL_C_INCLUDES := jni/include
 
 LOCAL_SRC_FILES := \
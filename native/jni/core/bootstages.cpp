@@ -59,6 +59,7 @@ else if (MNT_DIR_IS(dir) && me->mnt_type != "tmpfs"sv) { \
 #define link_orig(part) link_orig_dir("/" #part, part)
 
 static void mount_mirrors() {
+    trace_span span(__FUNCTION__);
     char buf1[4096];
     char buf2[4096];
 
@@ -100,6 +101,7 @@ static void mount_mirrors() {
 }
 
 static bool magisk_env() {
+    trace_span span(__FUNCTION__);
     char buf[4096];
 
     LOGI("* Initializing Magisk environment\n");
@@ -261,6 +263,7 @@ void post_fs_data(int client) {
     close(client);
 
     mutex_guard lock(stage_lock);
+    trace_span span("post-fs-data");
 
     if (getenv("REMOUNT_ROOT"))
         xmount(nullptr, "/", nullptr, MS_REMOUNT | MS_RDONLY, nullptr);
@@ -300,6 +303,7 @@ void post_fs_data(int client) {
         disable_modules();
         stop_magiskhide();
     } else {
+        start_script_runner();
         exec_common_scripts("post-fs-data");
         auto_start_magiskhide(false);
         handle_modules();
@@ -320,6 +324,7 @@ void late_start(int client) {
     close(client);
 
     mutex_guard lock(stage_lock);
+    trace_span span("late_start");
     run_finally fin([]{ DAEMON_STATE = STATE_LATE_START_DONE; });
     setup_logfile(false);
 
@@ -338,6 +343,7 @@ void boot_complete(int client) {
     close(client);
 
     mutex_guard lock(stage_lock);
+    trace_span span("boot_complete");
     DAEMON_STATE = STATE_BOOT_COMPLETE;
     setup_logfile(false);
 
@@ -351,6 +357,7 @@ void boot_complete(int client) {
         xmkdir(SECURE_DIR, 0700);
 
     auto_start_magiskhide(true);
+    remove_trash_modules();
 
     if (!check_manager()) {
         if (access(MANAGERAPK, F_OK) == 0) {
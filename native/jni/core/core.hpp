@@ -2,6 +2,7 @@
 
 #include <string>
 #include <vector>
+#include <cstdint>
 
 extern bool RECOVERY_MODE;
 extern int DAEMON_STATE;
@@ -13,15 +14,61 @@ void start_log_daemon();
 void setup_logfile(bool reset);
 
 // Module stuffs
+#define MODULE_DISABLE    (1 << 0)
+#define MODULE_REMOVE     (1 << 1)
+#define MODULE_UPDATE     (1 << 2)
+#define MODULE_SKIP_MOUNT (1 << 3)
+#define MODULE_PROP       (1 << 4)    /* system.prop */
+#define MODULE_SYSTEM     (1 << 5)    /* system folder */
+#define MODULE_POST_FS    (1 << 6)    /* post-fs-data.sh */
+#define MODULE_SERVICE    (1 << 7)    /* service.sh */
+#define MODULE_UNINSTALL  (1 << 8)    /* uninstall.sh */
+
+struct module_info {
+    std::string name;
+    unsigned flags = 0;
+    int wd = -1;                       /* inotify watch descriptor */
+    bool prop_loaded = false;
+    std::vector<std::string> after;    /* module.prop fields */
+};
+
+void load_module_prop(module_info &m);
+
 void handle_modules();
 void magic_mount();
 void disable_modules();
 void remove_modules();
+void remove_trash_modules();
 void exec_module_scripts(const char *stage);
 
 // Scripting
+void start_script_runner();
 void exec_script(const char *script);
 void exec_common_scripts(const char *stage);
-void exec_module_scripts(const char *stage, const std::vector<std::string> &module_list);
+void exec_module_scripts(const char *stage, std::vector<module_info> &module_list);
 void install_apk(const char *apk);
 [[noreturn]] void install_module(const char *file);
+
+// Boot timeline tracing
+struct trace_event {
+    char name[48];
+    int tid;
+    int64_t ts;   /* CLOCK_MONOTONIC in ns */
+    int64_t dur;  /* ns */
+};
+
+int64_t trace_now();
+void trace_record(const trace_event &e);
+void trace_record(const char *name, int64_t ts, int64_t dur);
+void dump_trace(int client);
+
+// Records the lifetime of the object as a span on the calling thread
+class trace_span {
+public:
+    explicit trace_span(const char *name) : name(name), start(trace_now()) {}
+    trace_span(const trace_span &) = delete;
+    ~trace_span() { trace_record(name, start, trace_now() - start); }
+private:
+    const char *name;
+    int64_t start;
+};
@@ -2,6 +2,9 @@
 #include <libgen.h>
 #include <sys/un.h>
 #include <sys/mount.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <optional>
 
 #include <magisk.hpp>
 #include <utils.hpp>
@@ -62,6 +65,12 @@ static void handle_request_async(int client, int code, ucred cred) {
     case SQLITE_CMD:
         exec_sql(client);
         break;
+    case SQLITE_QUERY:
+        stream_sql(client);
+        break;
+    case BOOT_TRACE:
+        dump_trace(client);
+        break;
     case REMOVE_MODULES:
         remove_modules();
         write_int(client, 0);
@@ -91,6 +100,141 @@ static void handle_request_sync(int client, int code) {
     }
 }
 
+// Return 0 if the client is allowed to issue the request, or the code to reply
+static int check_permission(int code, const ucred &cred, bool is_zygote) {
+    bool is_root = cred.uid == UID_ROOT;
+    switch (code) {
+    case POST_FS_DATA:
+    case LATE_START:
+    case BOOT_COMPLETE:
+    case SQLITE_CMD:
+    case SQLITE_QUERY:
+    case MULTIPLEX:
+    case BOOT_TRACE:
+    case GET_PATH:
+        if (!is_root)
+            return ROOT_REQUIRED;
+        break;
+    case REMOVE_MODULES:
+        if (!is_root && cred.uid != UID_SHELL)
+            return 1;
+        break;
+    case MAGISKHIDE:  // accept hide request from zygote
+        if (!is_root && !is_zygote)
+            return ROOT_REQUIRED;
+        break;
+    }
+    return 0;
+}
+
+// Anonymous file for framed requests
+static int request_file() {
+    int fd = memfd_create("magisk_req", MFD_CLOEXEC);
+    if (fd >= 0)
+        return fd;
+    // memfd_create requires Linux 3.17, fallback to an unlinked tmpfs file
+    string tmp = MAGISKTMP + "/.magisk_req.XXXXXX";
+    fd = mkstemp(tmp.data());
+    if (fd >= 0) {
+        unlink(tmp.data());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/* Requests that only exchange data with the client can go through a
+ * multiplexed connection. The handler runs against a file holding the
+ * request payload, and everything it writes after that becomes the reply. */
+static bool run_framed(daemon_frame &req, daemon_frame &reply, const ucred &cred) {
+    switch (req.code) {
+    case CHECK_VERSION:
+    case CHECK_VERSION_CODE:
+    case GET_PATH:
+    case MAGISKHIDE:
+    case SQLITE_CMD:
+    case SQLITE_QUERY:
+    case BOOT_TRACE:
+        break;
+    default:
+        return false;
+    }
+
+    int fd = request_file();
+    if (fd < 0)
+        return false;
+    xwrite(fd, req.data.data(), req.data.size());
+    lseek(fd, 0, SEEK_SET);
+    // Replies always go after the payload, regardless of how much is read
+    fcntl(fd, F_SETFL, O_APPEND);
+
+    if (req.code & SYNC_FLAG)
+        handle_request_sync(fd, req.code);
+    else
+        handle_request_async(xdup(fd), req.code, cred);
+
+    struct stat st;
+    fstat(fd, &st);
+    reply.data.resize(st.st_size - req.data.size());
+    pread(fd, reply.data.data(), reply.data.size(), req.data.size());
+    close(fd);
+    return true;
+}
+
+static void handle_multiplex(int client, const ucred &cred, bool is_zygote) {
+    write_int(client, MULTIPLEX_VERSION);
+    if (read_int(client) != MULTIPLEX_VERSION) {
+        close(client);
+        return;
+    }
+
+    vector<daemon_frame> replies;
+    /* Database writes of a burst are committed once, before replying. The
+     * write transaction is shared by the whole daemon, so it is never kept
+     * open while waiting for the client to send more. */
+    optional<db_batch> batch;
+    // Never wrap SQL that opens and commits its own transactions
+    bool client_txn = false;
+    for (daemon_frame req;;) {
+        if (batch && !frame_ready(client))
+            batch.reset();
+        if (!read_frame(client, req))
+            break;
+        auto &reply = replies.emplace_back();
+        reply.id = req.id;
+        reply.code = check_permission(req.code, cred, is_zygote);
+        if (reply.code == 0 && (req.code == SQLITE_CMD || req.code == SQLITE_QUERY)) {
+            // Both payloads start with the length prefixed SQL
+            string_view sql;
+            if (int len; req.data.size() >= sizeof(len)) {
+                memcpy(&len, req.data.data(), sizeof(len));
+                sql = string_view(req.data).substr(sizeof(len), std::max(len, 0));
+            }
+            int flags = sql_flags(sql);
+            if (flags & SQL_TXN) {
+                client_txn = true;
+                batch.reset();
+            } else if ((flags & SQL_WRITE) && !batch && !client_txn) {
+                // Only take the write lock once something is written
+                batch.emplace();
+            }
+        }
+        if (reply.code == 0 && !run_framed(req, reply, cred))
+            reply.code = DAEMON_ERROR;
+
+        // Batch replies as long as more requests are already queued
+        pollfd pfd = { .fd = client, .events = POLLIN };
+        if (replies.size() >= 64 || poll(&pfd, 1, 0) <= 0) {
+            batch.reset();
+            if (!write_frames(client, replies))
+                break;
+            replies.clear();
+        }
+    }
+    batch.reset();
+    write_frames(client, replies);
+    close(client);
+}
+
 static void handle_request(int client) {
     int code;
 
@@ -110,29 +254,9 @@ static void handle_request(int client) {
         goto done;
 
     // Check client permissions
-    switch (code) {
-    case POST_FS_DATA:
-    case LATE_START:
-    case BOOT_COMPLETE:
-    case SQLITE_CMD:
-    case GET_PATH:
-        if (!is_root) {
-            write_int(client, ROOT_REQUIRED);
-            goto done;
-        }
-        break;
-    case REMOVE_MODULES:
-        if (!is_root && cred.uid != UID_SHELL) {
-            write_int(client, 1);
-            goto done;
-        }
-        break;
-    case MAGISKHIDE:  // accept hide request from zygote
-        if (!is_root && !is_zygote) {
-            write_int(client, ROOT_REQUIRED);
-            goto done;
-        }
-        break;
+    if (int res = check_permission(code, cred, is_zygote); res) {
+        write_int(client, res);
+        goto done;
     }
 
     if (code & SYNC_FLAG) {
@@ -140,14 +264,77 @@ static void handle_request(int client) {
         goto done;
     }
 
-    // Create new thread to handle complex requests
-    new_daemon_thread([=] { handle_request_async(client, code, cred); });
+    if (code == MULTIPLEX) {
+        handle_multiplex(client, cred, is_zygote);
+        return;
+    }
+
+    // Complex requests are handled on the current worker
+    handle_request_async(client, code, cred);
     return;
 
 done:
     close(client);
 }
 
+/**************
+ * Worker Pool
+ **************/
+
+/* Clients are only handed to the pool once their request is readable, so
+ * credential checks never run on the accept loop. Idle workers above the
+ * minimum exit after a while. Long running requests (su sessions, boot
+ * stages) can occupy every worker, in that case requests overflow onto
+ * their own threads instead of waiting. */
+
+#define POOL_MIN_WORKERS  2
+#define POOL_MAX_WORKERS  16
+#define POOL_IDLE_TIME    30
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static deque<int> pending_clients;
+static int num_workers = 0;
+static int idle_workers = 0;
+
+static void *pool_worker(void *) {
+    pthread_mutex_lock(&pool_lock);
+    for (;;) {
+        while (pending_clients.empty()) {
+            timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += POOL_IDLE_TIME;
+            ++idle_workers;
+            int ret = pthread_cond_timedwait(&pool_cond, &pool_lock, &ts);
+            --idle_workers;
+            if (ret == ETIMEDOUT && pending_clients.empty() && num_workers > POOL_MIN_WORKERS) {
+                --num_workers;
+                pthread_mutex_unlock(&pool_lock);
+                return nullptr;
+            }
+        }
+        int client = pending_clients.front();
+        pending_clients.pop_front();
+        pthread_mutex_unlock(&pool_lock);
+        handle_request(client);
+        pthread_mutex_lock(&pool_lock);
+    }
+}
+
+static void dispatch_request(int client) {
+    mutex_guard lock(pool_lock);
+    if (idle_workers > static_cast<int>(pending_clients.size())) {
+        pending_clients.push_back(client);
+        pthread_cond_signal(&pool_cond);
+    } else if (num_workers < POOL_MAX_WORKERS) {
+        pending_clients.push_back(client);
+        ++num_workers;
+        new_daemon_thread(&pool_worker);
+    } else {
+        new_daemon_thread([=] { handle_request(client); });
+    }
+}
+
 static int switch_cgroup(const char *cgroup, int pid) {
     char buf[32];
     snprintf(buf, sizeof(buf), "%s/cgroup.procs", cgroup);
@@ -244,12 +431,38 @@ static int switch_cgroup(const char *cgroup, int pid) {
     fd = xsocket(AF_LOCAL, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (xbind(fd, (sockaddr*) &sun, len))
         exit(1);
-    xlisten(fd, 10);
+    xlisten(fd, SOMAXCONN);
+
+    int efd = xepoll_create1(EPOLL_CLOEXEC);
+    epoll_event event = { .events = EPOLLIN, .data = { .fd = fd } };
+    xepoll_ctl(efd, EPOLL_CTL_ADD, fd, &event);
+
+    {
+        mutex_guard lock(pool_lock);
+        num_workers = POOL_MIN_WORKERS;
+    }
+    for (int i = 0; i < POOL_MIN_WORKERS; ++i)
+        new_daemon_thread(&pool_worker);
 
     // Loop forever to listen for requests
+    epoll_event events[16];
     for (;;) {
-        int client = xaccept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
-        handle_request(client);
+        int num = epoll_wait(efd, events, std::size(events), -1);
+        for (int i = 0; i < num; ++i) {
+            if (events[i].data.fd == fd) {
+                int client = xaccept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+                if (client < 0)
+                    continue;
+                event = { .events = EPOLLIN | EPOLLRDHUP, .data = { .fd = client } };
+                if (xepoll_ctl(efd, EPOLL_CTL_ADD, client, &event))
+                    close(client);
+            } else {
+                // Request is readable, hand over to the pool
+                int client = events[i].data.fd;
+                epoll_ctl(efd, EPOLL_CTL_DEL, client, nullptr);
+                dispatch_request(client);
+            }
+        }
     }
 }
 
@@ -2,7 +2,12 @@
 #include <dlfcn.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <map>
+#include <memory>
+
 #include <magisk.hpp>
+#include <daemon.hpp>
 #include <db.hpp>
 #include <socket.hpp>
 #include <utils.hpp>
@@ -12,6 +17,7 @@
 using namespace std;
 
 typedef struct sqlite3 sqlite3;
+typedef void (*sqlite3_destructor_type)(void *);
 
 static sqlite3 *mDB = nullptr;
 
@@ -21,6 +27,14 @@ static sqlite3 *mDB = nullptr;
 #define SQLITE_OPEN_CREATE           0x00000004  /* Ok for sqlite3_open_v2() */
 #define SQLITE_OPEN_FULLMUTEX        0x00010000  /* Ok for sqlite3_open_v2() */
 
+#define SQLITE_OK           0   /* Successful result */
+#define SQLITE_ROW          100 /* sqlite3_step() has another row ready */
+#define SQLITE_DONE         101 /* sqlite3_step() has finished executing */
+
+#define SQLITE_NULL         5
+
+#define SQLITE_STATIC       ((sqlite3_destructor_type) 0)
+
 static int (*sqlite3_open_v2)(
         const char *filename,
         sqlite3 **ppDb,
@@ -35,6 +49,27 @@ static int (*sqlite3_exec)(
         int (*callback)(void*, int, char**, char**),
         void *v,
         char **errmsg);
+static char *(*sqlite3_mprintf)(const char *fmt, ...);
+static int (*sqlite3_prepare_v2)(
+        sqlite3 *db,
+        const char *zSql,
+        int nByte,
+        sqlite3_stmt **ppStmt,
+        const char **pzTail);
+static int (*sqlite3_bind_int64)(sqlite3_stmt *stmt, int idx, int64_t val);
+static int (*sqlite3_bind_text)(
+        sqlite3_stmt *stmt, int idx, const char *val, int n, sqlite3_destructor_type d);
+static int (*sqlite3_step)(sqlite3_stmt *stmt);
+static int (*sqlite3_reset)(sqlite3_stmt *stmt);
+static int (*sqlite3_clear_bindings)(sqlite3_stmt *stmt);
+static int (*sqlite3_column_count)(sqlite3_stmt *stmt);
+static const char *(*sqlite3_column_name)(sqlite3_stmt *stmt, int col);
+static int (*sqlite3_column_int)(sqlite3_stmt *stmt, int col);
+static int64_t (*sqlite3_column_int64)(sqlite3_stmt *stmt, int col);
+static const unsigned char *(*sqlite3_column_text)(sqlite3_stmt *stmt, int col);
+static int (*sqlite3_column_bytes)(sqlite3_stmt *stmt, int col);
+static int (*sqlite3_column_type)(sqlite3_stmt *stmt, int col);
+static int (*sqlite3_finalize)(sqlite3_stmt *stmt);
 
 // Internal Android linker APIs
 
@@ -92,6 +127,21 @@ static bool dload_sqlite() {
     DLOAD(sqlite, sqlite3_close);
     DLOAD(sqlite, sqlite3_exec);
     DLOAD(sqlite, sqlite3_free);
+    DLOAD(sqlite, sqlite3_mprintf);
+    DLOAD(sqlite, sqlite3_prepare_v2);
+    DLOAD(sqlite, sqlite3_bind_int64);
+    DLOAD(sqlite, sqlite3_bind_text);
+    DLOAD(sqlite, sqlite3_step);
+    DLOAD(sqlite, sqlite3_reset);
+    DLOAD(sqlite, sqlite3_clear_bindings);
+    DLOAD(sqlite, sqlite3_column_count);
+    DLOAD(sqlite, sqlite3_column_name);
+    DLOAD(sqlite, sqlite3_column_int);
+    DLOAD(sqlite, sqlite3_column_int64);
+    DLOAD(sqlite, sqlite3_column_text);
+    DLOAD(sqlite, sqlite3_column_bytes);
+    DLOAD(sqlite, sqlite3_column_type);
+    DLOAD(sqlite, sqlite3_finalize);
 
     dl_init = 1;
     return true;
@@ -112,6 +162,7 @@ db_settings::db_settings() {
     data[SU_MULTIUSER_MODE] = MULTIUSER_MODE_OWNER_ONLY;
     data[SU_MNT_NS] = NAMESPACE_MODE_REQUESTER;
     data[HIDE_CONFIG] = false;
+    data[SCRIPT_JOBS] = 0;  /* 0 = number of online CPUs */
 }
 
 int db_settings::getKeyIdx(string_view key) const {
@@ -138,9 +189,15 @@ static char *open_and_init_db(sqlite3 *&db) {
             SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX, nullptr);
     if (ret)
         return strdup(sqlite3_errmsg(db));
+    char *err;
+    // Writers only append to the WAL and fsync on checkpoints.
+    // Errors are not fatal here, as failing to open recreates the database
+    sqlite3_exec(db, "PRAGMA journal_mode=WAL", nullptr, nullptr, &err);
+    db_err(err);
+    sqlite3_exec(db, "PRAGMA synchronous=NORMAL", nullptr, nullptr, &err);
+    db_err(err);
     int ver;
     bool upgrade = false;
-    char *err;
     sqlite3_exec(db, "PRAGMA user_version", ver_cb, &ver, &err);
     err_ret(err);
     if (ver > DB_VERSION) {
@@ -238,35 +295,49 @@ static char *open_and_init_db(sqlite3 *&db) {
     return nullptr;
 }
 
-char *db_exec(const char *sql) {
-    char *err;
+static shared_ptr<const db_config> load_db_config();
+
+// Tables whose content is cached by the daemon
+static void check_db_write(const char *sql) {
+    string stmt(sql);
+    transform(stmt.begin(), stmt.end(), stmt.begin(), ::tolower);
+    size_t begin = stmt.find_first_not_of(" \t\n");
+    if (begin == string::npos || stmt.compare(begin, 6, "select") == 0)
+        return;
+    if (stmt.find("settings") != string::npos || stmt.find("strings") != string::npos)
+        load_db_config();
+    else if (stmt.find("policies") == string::npos)
+        return;
+    clear_su_cache();
+}
+
+static char *open_db() {
+    char *err = nullptr;
     if (mDB == nullptr) {
         err = open_and_init_db(mDB);
         db_err_cmd(err,
             // Open fails, remove and reconstruct
             unlink(MAGISKDB);
             err = open_and_init_db(mDB);
-            err_ret(err);
         );
     }
+    return err;
+}
+
+char *db_exec(const char *sql) {
+    char *err = open_db();
+    err_ret(err);
     if (mDB) {
         sqlite3_exec(mDB, sql, nullptr, nullptr, &err);
+        check_db_write(sql);
         return err;
     }
     return nullptr;
 }
 
 char *db_exec(const char *sql, const db_row_cb &fn) {
-    char *err;
-    if (mDB == nullptr) {
-        err = open_and_init_db(mDB);
-        db_err_cmd(err,
-            // Open fails, remove and reconstruct
-            unlink(MAGISKDB);
-            err = open_and_init_db(mDB);
-            err_ret(err);
-        );
-    }
+    char *err = open_db();
+    err_ret(err);
     if (mDB) {
         sqlite3_exec(mDB, sql, [](void *cb, int col_num, char **data, char **col_name) -> int {
             auto &func = *reinterpret_cast<const db_row_cb*>(cb);
@@ -275,54 +346,200 @@ char *db_exec(const char *sql, const db_row_cb &fn) {
                 row[col_name[i]] = data[i];
             return func(row) ? 0 : 1;
         }, (void *) &fn, &err);
+        check_db_write(sql);
         return err;
     }
     return nullptr;
 }
 
-int get_db_settings(db_settings &cfg, int key) {
-    char *err;
-    auto settings_cb = [&](db_row &row) -> bool {
-        cfg[row["key"]] = parse_int(row["value"]);
-        LOGD("magiskdb: query %s=[%s]\n", row["key"].data(), row["value"].data());
+int db_cursor::columns() const {
+    return sqlite3_column_count(stmt);
+}
+
+const char *db_cursor::name(int col) const {
+    return sqlite3_column_name(stmt, col);
+}
+
+int db_cursor::get_int(int col) const {
+    return sqlite3_column_int(stmt, col);
+}
+
+int64_t db_cursor::get_int64(int col) const {
+    return sqlite3_column_int64(stmt, col);
+}
+
+bool db_cursor::is_null(int col) const {
+    return sqlite3_column_type(stmt, col) == SQLITE_NULL;
+}
+
+string_view db_cursor::get_text(int col) const {
+    auto text = reinterpret_cast<const char *>(sqlite3_column_text(stmt, col));
+    if (text == nullptr)
+        return {};
+    return string_view(text, sqlite3_column_bytes(stmt, col));
+}
+
+/* Statements are prepared once and kept for the lifetime of the daemon, so
+ * db_query should only be used with constant SQL. Cached statements are
+ * shared, so the whole execution is serialized and callbacks must not run
+ * other queries. */
+static pthread_mutex_t stmt_lock = PTHREAD_MUTEX_INITIALIZER;
+static map<string, sqlite3_stmt *, less<>> stmt_cache;
+
+char *db_query(const char *sql, initializer_list<db_arg> args, const db_cursor_cb &fn) {
+    char *err = nullptr;
+    {
+        mutex_guard lock(stmt_lock);
+        err = open_db();
+        err_ret(err);
+        if (mDB == nullptr)
+            return nullptr;
+
+        sqlite3_stmt *stmt;
+        if (auto it = stmt_cache.find(sql); it != stmt_cache.end()) {
+            stmt = it->second;
+        } else {
+            if (sqlite3_prepare_v2(mDB, sql, -1, &stmt, nullptr) != SQLITE_OK)
+                return sqlite3_mprintf("%s", sqlite3_errmsg(mDB));
+            stmt_cache.emplace(sql, stmt);
+        }
+
+        int idx = 0;
+        for (auto &arg : args) {
+            ++idx;
+            if (arg.type == db_arg::INT)
+                sqlite3_bind_int64(stmt, idx, arg.num);
+            else
+                sqlite3_bind_text(stmt, idx, arg.text.data(), arg.text.size(), SQLITE_STATIC);
+        }
+
+        db_cursor cursor(stmt);
+        int ret;
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (fn && !fn(cursor))
+                break;
+        }
+        if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+            err = sqlite3_mprintf("%s", sqlite3_errmsg(mDB));
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+    }
+    if (strncmp(sql, "SELECT", 6) != 0)
+        check_db_write(sql);
+    return err;
+}
+
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static int batch_depth = 0;
+
+/* Statements are split on ';' without looking at quotes. Getting it wrong
+ * only results in an unneeded or skipped batch, never in a broken one. */
+int sql_flags(string_view sql) {
+    int flags = 0;
+    for (size_t pos = 0; pos < sql.size();) {
+        size_t end = sql.find(';', pos);
+        if (end == string_view::npos)
+            end = sql.size();
+        auto stmt = sql.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t begin = 0;
+        while (begin < stmt.size() && isspace(stmt[begin]))
+            ++begin;
+        size_t len = 0;
+        while (begin + len < stmt.size() && isalpha(stmt[begin + len]))
+            ++len;
+        if (len == 0)
+            continue;
+        string word(stmt.substr(begin, len));
+        for (char &c : word)
+            c = toupper(c);
+        if (word == "SELECT")
+            continue;
+        flags |= SQL_WRITE;
+        if (word == "BEGIN" || word == "COMMIT" || word == "END" ||
+            word == "ROLLBACK" || word == "SAVEPOINT" || word == "RELEASE")
+            flags |= SQL_TXN;
+    }
+    return flags;
+}
+
+db_batch::db_batch() {
+    mutex_guard lock(batch_lock);
+    if (batch_depth++ == 0)
+        db_err(db_exec("BEGIN IMMEDIATE"));
+}
+
+db_batch::~db_batch() {
+    mutex_guard lock(batch_lock);
+    if (--batch_depth == 0)
+        db_err(db_exec("COMMIT"));
+}
+
+/* The settings and strings tables are mirrored in memory. Readers grab the
+ * current snapshot without taking any lock, every write to either table
+ * through db_exec or db_query publishes a freshly loaded snapshot. */
+static pthread_mutex_t config_lock = PTHREAD_MUTEX_INITIALIZER;
+static shared_ptr<const db_config> db_cfg;
+
+static shared_ptr<const db_config> load_db_config() {
+    mutex_guard lock(config_lock);
+    auto cfg = make_shared<db_config>();
+    char *err = db_query("SELECT key, value FROM settings", {}, [&](const db_cursor &row) -> bool {
+        cfg->settings[row.get_text(0)] = row.get_int(1);
+        LOGD("magiskdb: query %s=[%d]\n", string(row.get_text(0)).data(), row.get_int(1));
         return true;
-    };
+    });
+    db_err_cmd(err, return nullptr);
+    err = db_query("SELECT key, value FROM strings", {}, [&](const db_cursor &row) -> bool {
+        cfg->strings[row.get_text(0)] = row.get_text(1);
+        return true;
+    });
+    db_err_cmd(err, return nullptr);
+    shared_ptr<const db_config> snapshot = std::move(cfg);
+    atomic_store(&db_cfg, snapshot);
+    return snapshot;
+}
+
+shared_ptr<const db_config> get_db_config() {
+    auto cfg = atomic_load(&db_cfg);
+    return cfg ? cfg : load_db_config();
+}
+
+int get_db_settings(db_settings &cfg, int key) {
+    auto db = get_db_config();
+    if (!db)
+        return 1;
     if (key >= 0) {
-        char query[128];
-        sprintf(query, "SELECT key, value FROM settings WHERE key='%s'", DB_SETTING_KEYS[key]);
-        err = db_exec(query, settings_cb);
+        cfg[key] = db->settings[key];
     } else {
-        err = db_exec("SELECT key, value FROM settings", settings_cb);
+        cfg = db->settings;
     }
-    db_err_cmd(err, return 1);
     return 0;
 }
 
 int get_db_strings(db_strings &str, int key) {
-    char *err;
-    auto string_cb = [&](db_row &row) -> bool {
-        str[row["key"]] = row["value"];
-        return true;
-    };
+    auto db = get_db_config();
+    if (!db)
+        return 1;
     if (key >= 0) {
-        char query[128];
-        sprintf(query, "SELECT key, value FROM strings WHERE key='%s'", DB_STRING_KEYS[key]);
-        err = db_exec(query, string_cb);
+        str[key] = db->strings[key];
     } else {
-        err = db_exec("SELECT key, value FROM strings", string_cb);
+        str = db->strings;
     }
-    db_err_cmd(err, return 1);
     return 0;
 }
 
-int get_uid_policy(su_access &su, int uid) {
-    char query[256], *err;
-    sprintf(query, "SELECT policy, logging, notification FROM policies "
-            "WHERE uid=%d AND (until=0 OR until>%li)", uid, time(nullptr));
-    err = db_exec(query, [&](db_row &row) -> bool {
-        su.policy = (policy_t) parse_int(row["policy"]);
-        su.log = parse_int(row["logging"]);
-        su.notify = parse_int(row["notification"]);
+int get_uid_policy(su_access &su, int uid, time_t *until) {
+    char *err = db_query(
+            "SELECT policy, logging, notification, until FROM policies "
+            "WHERE uid=? AND (until=0 OR until>?)",
+            { uid, (int64_t) time(nullptr) }, [&](const db_cursor &row) -> bool {
+        su.policy = (policy_t) row.get_int(0);
+        su.log = row.get_int(1);
+        su.notify = row.get_int(2);
+        if (until)
+            *until = row.get_int64(3);
         LOGD("magiskdb: query policy=[%d] log=[%d] notify=[%d]\n", su.policy, su.log, su.notify);
         return true;
     });
@@ -387,6 +604,101 @@ void exec_sql(int client) {
     db_err_cmd(err, return; );
 }
 
+/* Run arbitrary SQL, possibly multiple statements, without caching statements.
+ * The connection serializes each call by itself, and as no shared statement
+ * is involved, a slow consumer does not hold up other queries. */
+static char *db_stream(const char *sql, const function<bool(const db_cursor &, int)> &fn) {
+    char *err = open_db();
+    err_ret(err);
+    if (mDB == nullptr)
+        return nullptr;
+
+    const char *tail = sql;
+    for (int idx = 0; *tail; ++idx) {
+        sqlite3_stmt *stmt;
+        if (sqlite3_prepare_v2(mDB, tail, -1, &stmt, &tail) != SQLITE_OK) {
+            err = sqlite3_mprintf("%s", sqlite3_errmsg(mDB));
+            break;
+        }
+        // Whitespace or comments only
+        if (stmt == nullptr)
+            break;
+        db_cursor cursor(stmt);
+        bool stop = false;
+        int ret;
+        while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (!fn(cursor, idx)) {
+                stop = true;
+                break;
+            }
+        }
+        if (ret != SQLITE_ROW && ret != SQLITE_DONE)
+            err = sqlite3_mprintf("%s", sqlite3_errmsg(mDB));
+        sqlite3_finalize(stmt);
+        if (stop || err)
+            break;
+    }
+    check_db_write(sql);
+    return err;
+}
+
+#define SQL_FLUSH_SIZE (64 * 1024)
+
+static void buf_int(string &buf, int val) {
+    buf.append(reinterpret_cast<char *>(&val), sizeof(val));
+}
+
+static void buf_string(string &buf, string_view str) {
+    buf_int(buf, str.size());
+    buf.append(str);
+}
+
+void stream_sql(int client) {
+    run_finally f([=]{ close(client); });
+    string sql = read_string(client);
+    int limit = read_int(client);
+    int offset = read_int(client);
+
+    string buf;
+    buf.reserve(SQL_FLUSH_SIZE + 4096);
+    bool ok = true;
+    int last = -1;
+    int rows = 0;
+    char *err = db_stream(sql.data(), [&](const db_cursor &row, int idx) -> bool {
+        if (rows++ < offset)
+            return true;
+        if (limit >= 0 && rows > offset + limit)
+            return false;
+        int cols = row.columns();
+        if (idx != last) {
+            last = idx;
+            buf_int(buf, SQL_HEADER);
+            buf_int(buf, cols);
+            for (int i = 0; i < cols; ++i)
+                buf_string(buf, row.name(i));
+        }
+        buf_int(buf, SQL_ROW);
+        for (int i = 0; i < cols; ++i) {
+            if (row.is_null(i))
+                buf_int(buf, -1);
+            else
+                buf_string(buf, row.get_text(i));
+        }
+        if (buf.size() >= SQL_FLUSH_SIZE) {
+            ok = xwrite(client, buf.data(), buf.size()) == (ssize_t) buf.size();
+            buf.clear();
+        }
+        return ok;
+    });
+    buf_int(buf, SQL_END);
+    buf_int(buf, err ? 1 : 0);
+    if (err)
+        buf_string(buf, err);
+    if (ok)
+        xwrite(client, buf.data(), buf.size());
+    db_err(err);
+}
+
 bool db_err(char *e) {
     if (e) {
         LOGE("sqlite3_exec: %s\n", e);
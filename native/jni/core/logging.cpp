@@ -1,15 +1,30 @@
 #include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <poll.h>
 #include <android/log.h>
 
+#include <algorithm>
+
 #include <magisk.hpp>
 #include <utils.hpp>
 #include <daemon.hpp>
-#include <stream.hpp>
 
 #include "core.hpp"
 
 using namespace std;
 
+/*
+ * Threads of the daemon log into per-thread ring buffers as binary records
+ * stamped at the call site. Producers never wait: when a ring is full the
+ * message only goes to logcat. The writer thread drains all rings in
+ * batches, orders the records by time, and writes them out in one go.
+ *
+ * Forked children cannot reach the rings, they still send their messages
+ * through the non-blocking logging pipe, which also carries control
+ * messages and wakes up the writer.
+ */
+
 struct log_meta {
     int prio;
     int len;
@@ -17,7 +32,91 @@ struct log_meta {
     int tid;
 };
 
+// Maximum message length for pipes to transfer atomically
+#define MAX_MSG_LEN  (PIPE_BUF - sizeof(log_meta))
+
+#define LOG_RING_SIZE (32 * 1024)
+
+// Control messages sent through the pipe
+#define LOG_CTL_FILE  -1
+#define LOG_CTL_WAKE  -2
+
+struct log_record {
+    int64_t ts;
+    int tid;
+    int prio;
+    int len;
+};
+
+struct log_ring {
+    log_ring *next = nullptr;
+    atomic<bool> used = true;
+    atomic<uint32_t> head = 0;  /* Only written by the owner thread */
+    atomic<uint32_t> tail = 0;  /* Only written by the writer thread */
+    char data[LOG_RING_SIZE];
+
+    void copy_in(uint32_t pos, const void *buf, size_t len) {
+        pos %= LOG_RING_SIZE;
+        size_t first = std::min(len, (size_t) LOG_RING_SIZE - pos);
+        memcpy(data + pos, buf, first);
+        memcpy(data, (const char *) buf + first, len - first);
+    }
+
+    void copy_out(uint32_t pos, void *buf, size_t len) const {
+        pos %= LOG_RING_SIZE;
+        size_t first = std::min(len, (size_t) LOG_RING_SIZE - pos);
+        memcpy(buf, data + pos, first);
+        memcpy((char *) buf + first, data, len - first);
+    }
+
+    bool push(const log_record &rec, const char *msg) {
+        uint32_t h = head.load(memory_order_relaxed);
+        uint32_t size = sizeof(rec) + rec.len;
+        if (size > LOG_RING_SIZE - (h - tail.load(memory_order_acquire)))
+            return false;
+        copy_in(h, &rec, sizeof(rec));
+        copy_in(h + sizeof(rec), msg, rec.len);
+        // Ordered against the check of writer_idle in wake_writer
+        head.store(h + size);
+        return true;
+    }
+};
+
 static atomic<int> logd_fd = -1;
+static int logd_pid = -1;
+static pthread_key_t ring_key;
+static atomic<log_ring *> rings = nullptr;
+static atomic<bool> writer_idle = false;
+
+static void release_ring(void *ring) {
+    static_cast<log_ring *>(ring)->used = false;
+}
+
+// Rings are never freed, released rings are reused by new threads
+static log_ring *get_ring() {
+    if (auto ring = static_cast<log_ring *>(pthread_getspecific(ring_key)))
+        return ring;
+    log_ring *ring = rings.load(memory_order_acquire);
+    for (; ring; ring = ring->next) {
+        bool expected = false;
+        if (ring->used.compare_exchange_strong(expected, true))
+            break;
+    }
+    if (ring == nullptr) {
+        ring = new log_ring();
+        ring->next = rings.load(memory_order_relaxed);
+        while (!rings.compare_exchange_weak(ring->next, ring));
+    }
+    pthread_setspecific(ring_key, ring);
+    return ring;
+}
+
+static void wake_writer() {
+    if (writer_idle.exchange(false)) {
+        log_meta meta = { .prio = LOG_CTL_WAKE };
+        write(logd_fd, &meta, sizeof(meta));
+    }
+}
 
 void setup_logfile(bool reset) {
     if (logd_fd < 0)
@@ -25,17 +124,154 @@ void setup_logfile(bool reset) {
 
     iovec iov{};
     log_meta meta = {
-        .prio = -1,
+        .prio = LOG_CTL_FILE,
         .len = reset
     };
 
     iov.iov_base = &meta;
     iov.iov_len = sizeof(meta);
-    writev(logd_fd, &iov, 1);
+    // The pipe is non-blocking, but this message cannot be dropped
+    while (writev(logd_fd, &iov, 1) < 0 && errno == EAGAIN)
+        usleep(1000);
 }
 
-// Maximum message length for pipes to transfer atomically
-#define MAX_MSG_LEN  (PIPE_BUF - sizeof(log_meta))
+// The date and time part of the prefix only changes once per second
+struct log_formatter {
+    time_t sec = -1;
+    char date[32];
+    size_t date_len = 0;
+
+    void format(string &out, int64_t ts, int pid, int tid, int prio, const char *msg, int len) {
+        time_t s = ts / 1000000000;
+        if (s != sec) {
+            tm tm;
+            localtime_r(&s, &tm);
+            sec = s;
+            date_len = strftime(date, sizeof(date), "%m-%d %T", &tm);
+        }
+        char type;
+        switch (prio) {
+            case ANDROID_LOG_DEBUG:
+                type = 'D';
+                break;
+            case ANDROID_LOG_INFO:
+                type = 'I';
+                break;
+            case ANDROID_LOG_WARN:
+                type = 'W';
+                break;
+            default:
+                type = 'E';
+                break;
+        }
+        char aux[64];
+        int off = snprintf(aux, sizeof(aux), ".%03d %5d %5d %c : ",
+                (int) (ts / 1000000 % 1000), pid, tid, type);
+        out.append(date, date_len);
+        out.append(aux, off);
+        out.append(msg, len);
+    }
+};
+
+static int64_t log_now() {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct pending_log {
+    int64_t ts;
+    int pid;
+    int tid;
+    int prio;
+    size_t off;
+    int len;
+};
+
+/*
+ * The log file is rotated once it grows over LOG_MAX_SIZE, and on every boot.
+ * Rotated files are shifted through LOG_GENERATIONS numbered generations and
+ * compressed in the background with magiskboot when it is available.
+ * Messages logged before the file can be opened are kept in memory, up to
+ * LOG_EARLY_MAX bytes.
+ */
+#define LOG_MAX_SIZE     (1024 * 1024)
+#define LOG_GENERATIONS  3
+#define LOG_EARLY_MAX    (256 * 1024)
+#define LOG_COMPRESS     "gzip"
+#define LOG_COMPRESS_EXT ".gz"
+
+struct log_file {
+    int fd = -1;
+    size_t size = 0;
+    string early;
+    size_t dropped = 0;
+    int compressor = -1;
+
+    void write(const string &data) {
+        if (fd < 0) {
+            if (early.size() + data.size() <= LOG_EARLY_MAX)
+                early += data;
+            else
+                dropped += data.size();
+            return;
+        }
+        if (::write(fd, data.data(), data.size()) > 0)
+            size += data.size();
+        if (compressor > 0 && waitpid(compressor, nullptr, WNOHANG) != 0)
+            compressor = -1;
+        if (size >= LOG_MAX_SIZE)
+            open(true);
+    }
+
+    bool open(bool rotate) {
+        if (fd >= 0)
+            close(fd);
+        if (rotate)
+            this->rotate();
+        fd = ::open(LOGFILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        size = fstat(fd, &st) == 0 ? st.st_size : 0;
+        if (!early.empty()) {
+            string data;
+            data.swap(early);
+            if (dropped) {
+                char msg[96];
+                snprintf(msg, sizeof(msg), "*** %zu bytes of early log dropped ***\n", dropped);
+                data += msg;
+                dropped = 0;
+            }
+            write(data);
+        }
+        return true;
+    }
+
+    void rotate() {
+        // Generations are shifted by name, a running compression must finish first
+        if (compressor > 0)
+            waitpid(compressor, nullptr, 0);
+        compressor = -1;
+
+        char src[128], dest[128];
+        for (int i = LOG_GENERATIONS - 1; i > 0; --i) {
+            for (const char *ext : { "", LOG_COMPRESS_EXT }) {
+                snprintf(src, sizeof(src), LOGFILE ".%d%s", i, ext);
+                snprintf(dest, sizeof(dest), LOGFILE ".%d%s", i + 1, ext);
+                rename(src, dest);
+            }
+        }
+        strcpy(dest, LOGFILE ".1");
+        if (rename(LOGFILE, dest) != 0)
+            return;
+
+        if (access(DATABIN "/magiskboot", X_OK) == 0) {
+            exec_t exec{};
+            compressor = exec_command(exec, DATABIN "/magiskboot", "compress=" LOG_COMPRESS, dest);
+        }
+    }
+};
 
 static void logfile_writer(int pipefd) {
     run_finally close_socket([=] {
@@ -44,104 +280,122 @@ static void logfile_writer(int pipefd) {
         close(logd_fd.exchange(-1));
     });
 
-    struct {
-        void *data;
-        size_t len;
-    } tmp_buf{};
-    stream *strm = new byte_stream(tmp_buf.data, tmp_buf.len);
-
-    log_meta meta{};
+    log_file file;
+    log_formatter fmt;
+    vector<pending_log> batch;
+    string msgs;
+    string out;
     char buf[MAX_MSG_LEN];
-    char aux[64];
 
-    iovec iov[2];
-    iov[0].iov_base = aux;
-    iov[1].iov_base = buf;
+    auto flush = [&] {
+        if (batch.empty())
+            return;
+        stable_sort(batch.begin(), batch.end(), [](auto &a, auto &b) { return a.ts < b.ts; });
+        for (auto &log : batch)
+            fmt.format(out, log.ts, log.pid, log.tid, log.prio, msgs.data() + log.off, log.len);
+        file.write(out);
+        batch.clear();
+        msgs.clear();
+        out.clear();
+    };
 
     for (;;) {
-        // Read meta data
-        if (xread(pipefd, &meta, sizeof(meta)) != sizeof(meta))
-            return;
+        // Drain the pipe
+        for (log_meta meta{};;) {
+            ssize_t len = read(pipefd, &meta, sizeof(meta));
+            if (len < 0 && errno == EAGAIN)
+                break;
+            if (len != sizeof(meta))
+                return;
 
-        if (meta.prio < 0 && tmp_buf.len >= 0) {
-            run_finally free_buf([&] {
-                free(tmp_buf.data);
-                tmp_buf.data = nullptr;
-                tmp_buf.len = -1;
-            });
+            if (meta.prio == LOG_CTL_WAKE)
+                continue;
 
-            if (meta.len)
-                rename(LOGFILE, LOGFILE ".bak");
+            if (meta.prio == LOG_CTL_FILE) {
+                // Everything logged so far goes before the file switch
+                flush();
+                if (!file.open(meta.len))
+                    return;
+                continue;
+            }
 
-            int fd = open(LOGFILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
-            if (fd < 0)
+            // Read message, always sent along with the meta data
+            if (read(pipefd, buf, meta.len) != meta.len)
                 return;
-            if (tmp_buf.data)
-                write(fd, tmp_buf.data, tmp_buf.len);
-
-            delete strm;
-            strm = new fd_stream(fd);
-            continue;
+            batch.push_back({ log_now(), meta.pid, meta.tid, meta.prio, msgs.size(), meta.len });
+            msgs.append(buf, meta.len);
         }
 
-        // Read message
-        if (xread(pipefd, buf, meta.len) != meta.len)
-            return;
-
-        timeval tv;
-        tm tm;
-        gettimeofday(&tv, nullptr);
-        localtime_r(&tv.tv_sec, &tm);
-
-        // Format detailed info
-        char type;
-        switch (meta.prio) {
-            case ANDROID_LOG_DEBUG:
-                type = 'D';
-                break;
-            case ANDROID_LOG_INFO:
-                type = 'I';
-                break;
-            case ANDROID_LOG_WARN:
-                type = 'W';
-                break;
-            default:
-                type = 'E';
-                break;
+        // Drain all rings
+        for (auto ring = rings.load(memory_order_acquire); ring; ring = ring->next) {
+            uint32_t t = ring->tail.load(memory_order_relaxed);
+            uint32_t h = ring->head.load(memory_order_acquire);
+            while (t != h) {
+                log_record rec;
+                ring->copy_out(t, &rec, sizeof(rec));
+                batch.push_back({ rec.ts, logd_pid, rec.tid, rec.prio, msgs.size(), rec.len });
+                msgs.resize(msgs.size() + rec.len);
+                ring->copy_out(t + sizeof(rec), msgs.data() + msgs.size() - rec.len, rec.len);
+                t += sizeof(rec) + rec.len;
+            }
+            ring->tail.store(t, memory_order_release);
         }
-        int ms = tv.tv_usec / 1000;
-        size_t off = strftime(aux, sizeof(aux), "%m-%d %T", &tm);
-        off += snprintf(aux + off, sizeof(aux) - off,
-                ".%03d %5d %5d %c : ", ms, meta.pid, meta.tid, type);
 
-        iov[0].iov_len = off;
-        iov[1].iov_len = meta.len;
+        if (!batch.empty()) {
+            flush();
+            continue;
+        }
 
-        strm->writev(iov, 2);
+        // Nothing left, sleep until producers wake us up
+        writer_idle = true;
+        bool empty = true;
+        for (auto ring = rings.load(memory_order_acquire); ring; ring = ring->next) {
+            if (ring->head.load() != ring->tail.load(memory_order_relaxed))
+                empty = false;
+        }
+        if (empty) {
+            pollfd pfd = { .fd = pipefd, .events = POLLIN };
+            poll(&pfd, 1, -1);
+        }
+        writer_idle = false;
     }
 }
 
 static int magisk_log(int prio, const char *fmt, va_list ap) {
     char buf[MAX_MSG_LEN + 1];
     int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    if (len > (int) MAX_MSG_LEN)
+        len = MAX_MSG_LEN;
 
     if (logd_fd >= 0) {
-        log_meta meta = {
-            .prio = prio,
-            .len = len,
-            .pid = getpid(),
-            .tid = gettid()
-        };
-
-        iovec iov[2];
-        iov[0].iov_base = &meta;
-        iov[0].iov_len = sizeof(meta);
-        iov[1].iov_base = buf;
-        iov[1].iov_len = len;
-
-        if (writev(logd_fd, iov, 2) < 0) {
-            // Stop trying to write to file
-            close(logd_fd.exchange(-1));
+        if (getpid() == logd_pid) {
+            log_record rec = {
+                .ts = log_now(),
+                .tid = gettid(),
+                .prio = prio,
+                .len = len
+            };
+            // Drop the message from the log file if the ring is full
+            if (get_ring()->push(rec, buf))
+                wake_writer();
+        } else {
+            log_meta meta = {
+                .prio = prio,
+                .len = len,
+                .pid = getpid(),
+                .tid = gettid()
+            };
+
+            iovec iov[2];
+            iov[0].iov_base = &meta;
+            iov[0].iov_len = sizeof(meta);
+            iov[1].iov_base = buf;
+            iov[1].iov_len = len;
+
+            if (writev(logd_fd, iov, 2) < 0 && errno != EAGAIN) {
+                // Stop trying to write to file
+                close(logd_fd.exchange(-1));
+            }
         }
     }
     __android_log_write(prio, "Magisk", buf);
@@ -160,7 +414,9 @@ void magisk_logging() {
 
 void start_log_daemon() {
     int fds[2];
-    if (pipe2(fds, O_CLOEXEC) == 0) {
+    if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+        pthread_key_create(&ring_key, release_ring);
+        logd_pid = getpid();
         logd_fd = fds[1];
         new_daemon_thread([fd = fds[0]] { logfile_writer(fd); });
     }
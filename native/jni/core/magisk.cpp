@@ -2,6 +2,7 @@
 #include <libgen.h>
 
 #include <utils.hpp>
+#include <db.hpp>
 #include <magisk.hpp>
 #include <daemon.hpp>
 #include <selinux.hpp>
@@ -35,8 +36,11 @@ Advanced Options (Internal APIs):
    --restorecon              restore selinux context on Magisk files
    --clone-attr SRC DEST     clone permission, owner, and selinux context
    --clone SRC DEST          clone SRC to DEST
-   --sqlite SQL              exec SQL commands to Magisk database
+   --sqlite [--limit N] [--offset N] SQL [SQL...]
+                             exec SQL commands to Magisk database, optionally
+                             only printing N rows or skipping the first N rows
    --path                    print Magisk tmpfs mount path
+   --trace                   dump boot timeline in Chrome trace format
 
 Available applets:
 )EOF");
@@ -47,6 +51,123 @@ Available applets:
     exit(1);
 }
 
+// Print SQLITE_QUERY results in the "key=value|key=value" text format
+static int print_sql_rows(const function<bool(void *, size_t)> &read) {
+    auto read_i = [&](int &val) { return read(&val, sizeof(val)); };
+    auto read_s = [&](string &str) -> bool {
+        int len;
+        if (!read_i(len))
+            return false;
+        str.resize(len < 0 ? 0 : len);
+        return len <= 0 || read(str.data(), len);
+    };
+
+    vector<string> cols;
+    string val, line;
+    for (int tag; read_i(tag);) {
+        switch (tag) {
+        case SQL_HEADER: {
+            int num;
+            if (!read_i(num) || num < 0)
+                return 1;
+            cols.resize(num);
+            for (auto &col : cols) {
+                if (!read_s(col))
+                    return 1;
+            }
+            break;
+        }
+        case SQL_ROW:
+            line.clear();
+            for (size_t i = 0; i < cols.size(); ++i) {
+                if (!read_s(val))
+                    return 1;
+                if (i)
+                    line += '|';
+                line += cols[i];
+                line += '=';
+                line += val;
+            }
+            printf("%s\n", line.data());
+            break;
+        case SQL_END: {
+            int status;
+            if (!read_i(status))
+                return 1;
+            if (status && read_s(val))
+                fprintf(stderr, "%s\n", val.data());
+            return status;
+        }
+        default:
+            return 1;
+        }
+    }
+    return 1;
+}
+
+static void write_query(string &out, const char *sql, int limit, int offset) {
+    int len = strlen(sql);
+    out.append(reinterpret_cast<char *>(&len), sizeof(len));
+    out += sql;
+    out.append(reinterpret_cast<char *>(&limit), sizeof(limit));
+    out.append(reinterpret_cast<char *>(&offset), sizeof(offset));
+}
+
+// Pipeline all SQL commands through a single multiplexed connection
+static int sqlite_multiplex(int num, char *sqls[], int limit, int offset) {
+    int fd = connect_daemon();
+    write_int(fd, MULTIPLEX);
+    if (read_int(fd) != MULTIPLEX_VERSION) {
+        fprintf(stderr, "Unsupported daemon protocol\n");
+        return 1;
+    }
+    write_int(fd, MULTIPLEX_VERSION);
+
+    vector<daemon_frame> reqs(num);
+    for (int i = 0; i < num; ++i) {
+        reqs[i].id = i;
+        reqs[i].code = SQLITE_QUERY;
+        write_query(reqs[i].data, sqls[i], limit, offset);
+    }
+    // Send from another thread so replies are consumed while requests are still
+    // being written, otherwise both sides block once the socket buffers are full
+    new_daemon_thread([fd, reqs = std::move(reqs)] {
+        write_frames(fd, reqs);
+        shutdown(fd, SHUT_WR);
+    });
+
+    int ret = 0;
+    // Query results are only limited by the daemon
+    for (daemon_frame reply; read_frame(fd, reply, UINT32_MAX);) {
+        string_view data = reply.data;
+        if (reply.code || print_sql_rows([&](void *buf, size_t len) -> bool {
+            if (data.size() < len)
+                return false;
+            memcpy(buf, data.data(), len);
+            data.remove_prefix(len);
+            return true;
+        })) {
+            ret = 1;
+        }
+    }
+    close(fd);
+    return ret;
+}
+
+static int sqlite_query(const char *sql, int limit, int offset) {
+    int fd = connect_daemon();
+    write_int(fd, SQLITE_QUERY);
+    string req;
+    write_query(req, sql, limit, offset);
+    xwrite(fd, req.data(), req.size());
+    FILE *fp = xfdopen(fd, "r");
+    int ret = print_sql_rows([=](void *buf, size_t len) -> bool {
+        return fread(buf, 1, len, fp) == len;
+    });
+    fclose(fp);
+    return ret;
+}
+
 int magisk_main(int argc, char *argv[]) {
     if (argc < 2)
         usage();
@@ -97,16 +218,20 @@ int magisk_main(int argc, char *argv[]) {
         write_int(fd, BOOT_COMPLETE);
         return read_int(fd);
     } else if (argc >= 3 && argv[1] == "--sqlite"sv) {
-        int fd = connect_daemon();
-        write_int(fd, SQLITE_CMD);
-        write_string(fd, argv[2]);
-        string res;
-        for (;;) {
-            read_string(fd, res);
-            if (res.empty())
-                return 0;
-            printf("%s\n", res.data());
+        int limit = -1, offset = 0, i = 2;
+        for (; i + 1 < argc; i += 2) {
+            if (argv[i] == "--limit"sv)
+                limit = parse_int(argv[i + 1]);
+            else if (argv[i] == "--offset"sv)
+                offset = parse_int(argv[i + 1]);
+            else
+                break;
         }
+        if (i >= argc)
+            usage();
+        if (argc - i > 1)
+            return sqlite_multiplex(argc - i, argv + i, limit, offset);
+        return sqlite_query(argv[i], limit, offset);
     } else if (argv[1] == "--remove-modules"sv) {
         int fd = connect_daemon();
         write_int(fd, REMOVE_MODULES);
@@ -117,6 +242,12 @@ int magisk_main(int argc, char *argv[]) {
         string path = read_string(fd);
         printf("%s\n", path.data());
         return 0;
+    } else if (argv[1] == "--trace"sv) {
+        int fd = connect_daemon();
+        write_int(fd, BOOT_TRACE);
+        string trace = read_string(fd);
+        printf("%s\n", trace.data());
+        return 0;
     } else if (argc >= 3 && argv[1] == "--install-module"sv) {
         install_module(argv[2]);
     }
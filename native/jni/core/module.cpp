@@ -1,5 +1,8 @@
 #include <sys/mount.h>
+#include <sys/inotify.h>
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <utility>
 
 #include <utils.hpp>
@@ -21,7 +24,15 @@ using namespace std;
 #define TYPE_CUSTOM  (1 << 5)    /* custom node type overrides all */
 #define TYPE_DIR     (TYPE_INTER|TYPE_SKEL|TYPE_ROOT)
 
-static vector<string> module_list;
+static vector<module_info> module_list;
+// Guards module_list, which is rescanned from the daemon's request threads
+static pthread_mutex_t inventory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copy the inventory so long running users do not hold the lock
+static vector<module_info> module_snapshot() {
+    mutex_guard lock(inventory_lock);
+    return module_list;
+}
 
 class node_entry;
 class dir_node;
@@ -62,6 +73,7 @@ public:
     // Paths
     const string &node_path();
     string mirror_path() { return mirror_dir + node_path(); }
+    string mount_path();
 
     dir_node *parent() { return _parent; }
 
@@ -70,6 +82,10 @@ public:
     static string module_mnt;
     static string mirror_dir;
 
+    // Skeleton currently built in the staging directory, see skel_node::stage()
+    static string stage_dir;
+    static string stage_node;
+
 protected:
     template<class T>
     node_entry(const char *name, uint8_t file_type, T*)
@@ -121,6 +137,9 @@ public:
     // Return false to indicate need to upgrade to skeleton
     bool prepare();
 
+    // Whether the subtree only consists of plain module files
+    bool can_overlay();
+
     // Default directory mount logic
     void mount() override {
         for (auto &pair : children)
@@ -270,6 +289,8 @@ class skel_node : public dir_node {
 public:
     explicit skel_node(node_entry *node);
     void mount() override;
+private:
+    bool stage(file_attr *a);
 };
 
 // Poor man's dynamic cast without RTTI
@@ -301,6 +322,8 @@ static void merge_node(node_entry *a, node_entry *b) {
 
 string node_entry::module_mnt;
 string node_entry::mirror_dir;
+string node_entry::stage_dir;
+string node_entry::stage_node;
 
 const string &node_entry::node_path() {
     if (_parent && _node_path.empty())
@@ -308,6 +331,19 @@ const string &node_entry::node_path() {
     return _node_path;
 }
 
+// Where the node is created, which is inside the staging directory while
+// the skeleton it belongs to is being built
+string node_entry::mount_path() {
+    const string &path = node_path();
+    if (stage_node.empty() || path.compare(0, stage_node.length(), stage_node) != 0)
+        return path;
+    if (path.length() == stage_node.length())
+        return stage_dir;
+    if (path[stage_node.length()] != '/')
+        return path;
+    return stage_dir + path.substr(stage_node.length());
+}
+
 /*************************
  * Node Tree Construction
  *************************/
@@ -445,12 +481,26 @@ bool dir_node::collect_files(const char *module, int dfd) {
     return true;
 }
 
+bool dir_node::can_overlay() {
+    for (auto &pair : children) {
+        auto node = pair.second;
+        if (auto dn = dyn_cast<inter_node>(node); dn) {
+            if (!dn->can_overlay())
+                return false;
+        } else if (!isa<module_node>(node) || node->is_dir()) {
+            // Injected custom nodes or replaced directories
+            return false;
+        }
+    }
+    return true;
+}
+
 /************************
  * Mount Implementations
  ************************/
 
 void node_entry::create_and_mount(const string &src) {
-    const string &dest = node_path();
+    string dest = mount_path();
     if (is_lnk()) {
         VLOGD("cp_link", src.data(), dest.data());
         cp_afc(src.data(), dest.data());
@@ -479,11 +529,13 @@ void skel_node::mount() {
     if (!exist())
         return;
     string src = mirror_path();
-    const string &dest = node_path();
+    string dest = mount_path();
     file_attr a;
     getattr(src.data(), &a);
     mkdir(dest.data(), 0);
     if (!isa<skel_node>(parent())) {
+        if (stage(&a))
+            return;
         // We don't need another layer of tmpfs if parent is skel
         xmount("tmpfs", dest.data(), "tmpfs", 0, nullptr);
         VLOGD("mnt_tmp", "tmpfs", dest.data());
@@ -492,6 +544,37 @@ void skel_node::mount() {
     dir_node::mount();
 }
 
+/* Build the whole skeleton on a tmpfs in the private staging directory, then
+ * move it onto the target with a single move_mount. The target only ever
+ * sees the finished tree, and it is propagated to peer mounts at once.
+ * Returns false if nothing was attached. */
+bool skel_node::stage(file_attr *a) {
+    if (stage_dir.empty())
+        return false;
+    const string &dest = node_path();
+    if (xmount("tmpfs", stage_dir.data(), "tmpfs", 0, nullptr))
+        return false;
+    setattr(stage_dir.data(), a);
+    stage_node = dest;
+    dir_node::mount();
+    stage_node.clear();
+
+    // Moving instead of cloning, the mounts are never copied
+    bool ok = false;
+    int tree = open_tree(AT_FDCWD, stage_dir.data(), OPEN_TREE_CLOEXEC);
+    if (tree >= 0) {
+        ok = move_mount(tree, "", AT_FDCWD, dest.data(), MOVE_MOUNT_F_EMPTY_PATH) == 0;
+        close(tree);
+    }
+    if (ok) {
+        VLOGD("mv_tree", "tmpfs", dest.data());
+    } else {
+        PLOGE("attach skeleton %s", dest.data());
+        umount2(stage_dir.data(), MNT_DETACH);
+    }
+    return ok;
+}
+
 /****************
  * Magisk Stuffs
  ****************/
@@ -501,7 +584,7 @@ public:
     explicit magisk_node(const char *name) : node_entry(name, DT_REG, this) {}
 
     void mount() override {
-        const string &dir_name = parent()->node_path();
+        string dir_name = parent()->mount_path();
         if (name() == "magisk") {
             for (int i = 0; applet_names[i]; ++i) {
                 string dest = dir_name + "/" + applet_names[i];
@@ -537,7 +620,124 @@ static void inject_magisk_bins(root_node *system) {
         delete bin->extract(init_applet[i]);
 }
 
+/*********************
+ * OverlayFS Backend
+ *********************/
+
+static bool overlay_supported() {
+    bool ret = false;
+    file_readline("/proc/filesystems", [&](string_view line) -> bool {
+        if (line.find("\toverlay") != string_view::npos) {
+            ret = true;
+            return false;
+        }
+        return true;
+    });
+    return ret;
+}
+
+/* Stack the module folders of a partition as lower layers above its mirror.
+ * Partitions with nested mount points are left to magic mount, since an
+ * overlay would hide them. */
+static bool mount_overlay(root_node *part, const vector<const char *> &modules) {
+    const string &dest = part->node_path();
+    bool nested = false;
+    parse_mnt("/proc/self/mounts", [&](mntent *me) {
+        nested = str_starts(me->mnt_dir, dest + "/");
+        return !nested;
+    });
+    if (nested)
+        return false;
+
+    string opts = "lowerdir=";
+    struct stat st;
+    for (auto module : modules) {
+        string dir = node_entry::module_mnt + module + part->prefix + dest;
+        if (stat(dir.data(), &st) || !S_ISDIR(st.st_mode))
+            continue;
+        if (dir.find_first_of(":,") != string::npos)
+            return false;
+        opts += dir;
+        opts += ':';
+    }
+    opts += part->mirror_path();
+    if (opts.size() >= 4096)
+        return false;
+
+    if (mount("magisk", dest.data(), "overlay", MS_RDONLY, opts.data())) {
+        LOGW("overlay: failed to mount %s, fallback to magic mount\n", dest.data());
+        return false;
+    }
+    LOGI("overlay: %s\n", dest.data());
+    return true;
+}
+
+struct prop_worker {
+    pthread_t thread;
+    vector<const module_info *> *mods;
+    vector<vector<pair<string, string>>> *props;
+    atomic<size_t> *next;
+};
+
+static void *prop_thread(void *arg) {
+    auto w = static_cast<prop_worker *>(arg);
+    char buf[4096];
+    for (size_t i; (i = (*w->next)++) < w->mods->size();) {
+        sprintf(buf, "%s/" MODULEMNT "/%s/system.prop", MAGISKTMP.data(), (*w->mods)[i]->name.data());
+        auto &props = (*w->props)[i];
+        parse_prop_file(buf, [&](string_view key, string_view val) -> bool {
+            props.emplace_back(key, val);
+            return true;
+        });
+    }
+    return nullptr;
+}
+
+// Parse all system.prop concurrently, then apply them as one batch in module order
+static void load_module_props(const vector<module_info> &modules) {
+    vector<const module_info *> mods;
+    for (const auto &m : modules) {
+        if ((m.flags & (MODULE_DISABLE | MODULE_PROP)) == MODULE_PROP)
+            mods.push_back(&m);
+    }
+    if (mods.empty())
+        return;
+
+    vector<vector<pair<string, string>>> props(mods.size());
+    atomic<size_t> next = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num = std::min<size_t>(std::max(cpus, 1L), mods.size());
+    vector<prop_worker> workers(num);
+    for (auto &w : workers) {
+        w.mods = &mods;
+        w.props = &props;
+        w.next = &next;
+    }
+    for (size_t i = 1; i < num; ++i)
+        xpthread_create(&workers[i].thread, nullptr, prop_thread, &workers[i]);
+    prop_thread(&workers[0]);
+    for (size_t i = 1; i < num; ++i)
+        pthread_join(workers[i].thread, nullptr);
+
+    // Later modules override earlier ones, but keep the first position
+    vector<pair<string, string>> batch;
+    unordered_map<string, size_t> index;
+    for (size_t i = 0; i < mods.size(); ++i) {
+        LOGI("%s: loading [system.prop]\n", mods[i]->name.data());
+        for (auto &[key, val] : props[i]) {
+            if (auto it = index.find(key); it != index.end()) {
+                batch[it->second].second = std::move(val);
+            } else {
+                index.emplace(key, batch.size());
+                batch.emplace_back(key, std::move(val));
+            }
+        }
+    }
+    setprops(batch, false);
+}
+
 void magic_mount() {
+    trace_span span(__FUNCTION__);
     node_entry::mirror_dir = MAGISKTMP + "/" MIRRDIR;
     node_entry::module_mnt = MAGISKTMP + "/" MODULEMNT "/";
 
@@ -545,35 +745,32 @@ void magic_mount() {
     auto system = new root_node("system");
     root->insert(system);
 
+    auto mods = module_snapshot();
+    load_module_props(mods);
+
     char buf[4096];
+    vector<const char *> modules;
     LOGI("* Loading modules\n");
-    for (const auto &m : module_list) {
-        auto module = m.data();
-        char *b = buf + sprintf(buf, "%s/" MODULEMNT "/%s/", MAGISKTMP.data(), module);
-
-        // Read props
-        strcpy(b, "system.prop");
-        if (access(buf, F_OK) == 0) {
-            LOGI("%s: loading [system.prop]\n", module);
-            load_prop_file(buf, false);
-        }
-
-        // Check whether skip mounting
-        strcpy(b, "skip_mount");
-        if (access(buf, F_OK) == 0)
+    for (const auto &m : mods) {
+        if (m.flags & MODULE_DISABLE)
             continue;
+        auto module = m.name.data();
+        char *b = buf + sprintf(buf, "%s/" MODULEMNT "/%s/", MAGISKTMP.data(), module);
 
-        // Double check whether the system folder exists
-        strcpy(b, "system");
-        if (access(buf, F_OK) != 0)
+        // Check whether skip mounting, or the system folder does not exist
+        if ((m.flags & MODULE_SKIP_MOUNT) || !(m.flags & MODULE_SYSTEM))
             continue;
 
         LOGI("%s: loading mount files\n", module);
+        modules.push_back(module);
+        // collect_files opens "system" relative to the module directory
         b[-1] = '\0';
         int fd = xopen(buf, O_RDONLY | O_CLOEXEC);
         system->collect_files(module, fd);
         close(fd);
     }
+    if (!modules.empty() && system->is_empty())
+        LOGW("* No files collected from %zu modules\n", modules.size());
 
     if (MAGISKTMP != "/sbin") {
         // Need to inject our binaries into /system/bin
@@ -594,8 +791,49 @@ void magic_mount() {
         }
     }
 
+    // Use overlayfs for partitions that only contain plain module files,
+    // which only costs a single mount per partition
+    if (overlay_supported()) {
+        for (const char *part : { "system", "vendor", "product", "system_ext" }) {
+            auto node = root->child<root_node>(part);
+            if (!node || !node->can_overlay())
+                continue;
+            // Module folders of split partitions would shadow the links in /system
+            if (node == system && any_of(modules.begin(), modules.end(), [&](auto module) {
+                for (const char *sub : { "vendor", "product", "system_ext" }) {
+                    if (root->child<root_node>(sub) &&
+                        access((node_entry::module_mnt + module + "/system/" + sub).data(), F_OK) == 0)
+                        return true;
+                }
+                return false;
+            }))
+                continue;
+            if (mount_overlay(node, modules))
+                delete root->extract(part);
+        }
+    }
+
     root->prepare();
+
+    // With the new mount API (Linux 5.2+), skeletons are built in a private
+    // staging directory and attached at once, otherwise fallback to mount(2)
+    string stage = MAGISKTMP + "/" INTLROOT "/stage";
+    if (int fd = open_tree(AT_FDCWD, "/", OPEN_TREE_CLOEXEC); fd >= 0) {
+        close(fd);
+        xmkdir(stage.data(), 0);
+        if (xmount(stage.data(), stage.data(), nullptr, MS_BIND, nullptr) == 0) {
+            xmount(nullptr, stage.data(), nullptr, MS_PRIVATE, nullptr);
+            node_entry::stage_dir = stage;
+        }
+    }
+
     root->mount();
+
+    if (!node_entry::stage_dir.empty()) {
+        node_entry::stage_dir.clear();
+        umount2(stage.data(), MNT_DETACH);
+        rmdir(stage.data());
+    }
 }
 
 static void prepare_modules() {
@@ -605,22 +843,31 @@ static void prepare_modules() {
         int mfd = xopen(MODULEROOT, O_RDONLY | O_CLOEXEC);
         for (dirent *entry; (entry = xreaddir(dir.get()));) {
             if (entry->d_type == DT_DIR) {
-                // Cleanup old module if exists
+                LOGI("Upgrade / New module: %s\n", entry->d_name);
                 if (faccessat(mfd, entry->d_name, F_OK, 0) == 0) {
-                    int modfd = xopenat(mfd, entry->d_name, O_RDONLY | O_CLOEXEC);
-                    if (faccessat(modfd, "disable", F_OK, 0) == 0) {
+                    if (faccessat(mfd, (entry->d_name + "/disable"s).data(), F_OK, 0) == 0) {
                         auto disable = entry->d_name + "/disable"s;
                         close(xopenat(ufd, disable.data(), O_RDONLY | O_CREAT | O_CLOEXEC, 0));
                     }
+                    // Swap in the new module, the old one is left in the upgrade folder
+                    if (renameat2(ufd, entry->d_name, mfd, entry->d_name, RENAME_EXCHANGE) == 0)
+                        continue;
+                    // Cleanup old module if exchange is not supported
+                    int modfd = xopenat(mfd, entry->d_name, O_RDONLY | O_CLOEXEC);
                     frm_rf(modfd);
                     unlinkat(mfd, entry->d_name, AT_REMOVEDIR);
                 }
-                LOGI("Upgrade / New module: %s\n", entry->d_name);
                 renameat(ufd, entry->d_name, mfd, entry->d_name);
             }
         }
         close(mfd);
-        rm_rf(MODULEUPGRADE);
+
+        // Old modules are deleted in the background after boot completes
+        char trash[sizeof(MODULETRASH) + 16];
+        sprintf(trash, MODULETRASH "/%ld", (long) time(nullptr));
+        xmkdir(MODULETRASH, 0755);
+        if (rename(MODULEUPGRADE, trash))
+            rm_rf(MODULEUPGRADE);
     }
 
     // Setup module mount (workaround nosuid selabel issue)
@@ -629,68 +876,240 @@ static void prepare_modules() {
     xmkdir(dest.data(), 0755);
     bind_mount(src.data(), dest.data());
 
-    restorecon();
+    {
+        trace_span span("restorecon");
+        restorecon();
+    }
     chmod(SECURE_DIR, 0700);
 }
 
-template<typename Func>
-static void foreach_module(Func fn) {
-    auto dir = open_dir(MODULEROOT);
-    if (!dir)
+/************************
+ * Module Inventory
+ ************************/
+
+// Modules are scanned once and kept sorted by name. Afterwards only the
+// entries reported dirty by inotify are scanned again.
+
+#define ROOT_EVENTS   (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                       IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+#define MODULE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                       IN_CLOSE_WRITE | IN_ONLYDIR)
+
+static int inotify_fd = -1;
+static int root_wd = -1;
+
+static const pair<string_view, unsigned> module_files[] = {
+    { "disable", MODULE_DISABLE },
+    { "remove", MODULE_REMOVE },
+    { "update", MODULE_UPDATE },
+    { "skip_mount", MODULE_SKIP_MOUNT },
+    { "system.prop", MODULE_PROP },
+    { "system", MODULE_SYSTEM },
+    { "post-fs-data.sh", MODULE_POST_FS },
+    { "service.sh", MODULE_SERVICE },
+    { "uninstall.sh", MODULE_UNINSTALL },
+};
+
+static void scan_module(int dfd, module_info &m) {
+    m.flags = 0;
+    m.prop_loaded = false;
+    m.after.clear();
+    int fd = openat(dfd, m.name.data(), O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+    if (fd < 0)
         return;
+    auto dir = xopen_dir(fd);
+    for (dirent *entry; (entry = xreaddir(dir.get()));) {
+        for (auto &[file, flag] : module_files) {
+            if (file == entry->d_name) {
+                if (flag != MODULE_SYSTEM || entry->d_type == DT_DIR)
+                    m.flags |= flag;
+                break;
+            }
+        }
+    }
+}
+
+static auto find_module(string_view name) {
+    return lower_bound(module_list.begin(), module_list.end(), name,
+            [](const module_info &m, string_view n) { return m.name < n; });
+}
+
+static vector<module_info>::iterator drop_module(vector<module_info>::iterator it) {
+    if (it->wd >= 0)
+        inotify_rm_watch(inotify_fd, it->wd);
+    return module_list.erase(it);
+}
+
+static void rescan_module(int dfd, string_view name) {
+    auto it = find_module(name);
+    bool found = it != module_list.end() && it->name == name;
+    struct stat st;
+    if (name == ".core" || fstatat(dfd, name.data(), &st, AT_SYMLINK_NOFOLLOW) ||
+        !S_ISDIR(st.st_mode)) {
+        if (found)
+            drop_module(it);
+        return;
+    }
+    if (!found) {
+        it = module_list.emplace(it);
+        it->name = name;
+        if (inotify_fd >= 0) {
+            auto path = MODULEROOT "/"s + it->name;
+            it->wd = inotify_add_watch(inotify_fd, path.data(), MODULE_EVENTS);
+        }
+    }
+    scan_module(dfd, *it);
+}
+
+static void scan_modules(int dfd) {
+    if (inotify_fd >= 0)
+        close(inotify_fd);
+    module_list.clear();
+    inotify_fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (inotify_fd >= 0)
+        root_wd = inotify_add_watch(inotify_fd, MODULEROOT, ROOT_EVENTS);
 
-    int dfd = dirfd(dir.get());
+    auto dir = xopen_dir(xdup(dfd));
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
-        if (entry->d_type == DT_DIR && entry->d_name != ".core"sv) {
-            int modfd = xopenat(dfd, entry->d_name, O_RDONLY | O_CLOEXEC);
-            fn(dfd, entry, modfd);
-            close(modfd);
+        if (entry->d_type == DT_DIR)
+            rescan_module(dfd, entry->d_name);
+    }
+}
+
+// Returns false if the inventory can no longer be trusted
+static bool handle_events(int dfd) {
+    char buf[4096] __attribute__((aligned(__alignof__(inotify_event))));
+    vector<string> dirty;
+    for (ssize_t len; (len = read(inotify_fd, buf, sizeof(buf))) > 0;) {
+        for (char *p = buf; p < buf + len;) {
+            auto event = reinterpret_cast<inotify_event *>(p);
+            p += sizeof(*event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW)
+                return false;
+            if (event->wd == root_wd) {
+                if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                    return false;
+                if (event->len)
+                    dirty.emplace_back(event->name);
+            } else {
+                auto it = find_if(module_list.begin(), module_list.end(),
+                        [=](const module_info &m) { return m.wd == event->wd; });
+                if (it != module_list.end())
+                    dirty.push_back(it->name);
+            }
         }
     }
+    sort(dirty.begin(), dirty.end());
+    dirty.erase(unique(dirty.begin(), dirty.end()), dirty.end());
+    for (auto &name : dirty)
+        rescan_module(dfd, name);
+    return true;
+}
+
+static void refresh_modules() {
+    int dfd = open(MODULEROOT, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+    if (dfd < 0) {
+        module_list.clear();
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        inotify_fd = -1;
+        return;
+    }
+    if (inotify_fd < 0 || !handle_events(dfd))
+        scan_modules(dfd);
+    close(dfd);
+}
+
+void load_module_prop(module_info &m) {
+    if (m.prop_loaded)
+        return;
+    m.prop_loaded = true;
+    auto prop = MODULEROOT "/"s + m.name + "/module.prop";
+    parse_prop_file(prop.data(), [&](string_view key, string_view val) -> bool {
+        if (key != "after")
+            return true;
+        for (size_t pos = 0; pos < val.size();) {
+            size_t end = val.find(',', pos);
+            if (end == string_view::npos)
+                end = val.size();
+            if (end > pos)
+                m.after.emplace_back(val.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        return false;
+    });
 }
 
 static void collect_modules() {
-    foreach_module([](int dfd, dirent *entry, int modfd) {
-        if (faccessat(modfd, "remove", F_OK, 0) == 0) {
-            LOGI("%s: remove\n", entry->d_name);
-            auto uninstaller = MODULEROOT + "/"s + entry->d_name + "/uninstall.sh";
-            if (access(uninstaller.data(), F_OK) == 0)
+    mutex_guard lock(inventory_lock);
+    refresh_modules();
+    int dfd = open(MODULEROOT, O_RDONLY | O_CLOEXEC | O_DIRECTORY);
+    if (dfd < 0)
+        return;
+    for (auto it = module_list.begin(); it != module_list.end();) {
+        auto name = it->name.data();
+        if (it->flags & MODULE_REMOVE) {
+            LOGI("%s: remove\n", name);
+            if (it->flags & MODULE_UNINSTALL) {
+                auto uninstaller = MODULEROOT "/"s + name + "/uninstall.sh";
                 exec_script(uninstaller.data());
-            frm_rf(xdup(modfd));
-            unlinkat(dfd, entry->d_name, AT_REMOVEDIR);
-            return;
+            }
+            frm_rf(xopenat(dfd, name, O_RDONLY | O_CLOEXEC));
+            unlinkat(dfd, name, AT_REMOVEDIR);
+            it = drop_module(it);
+            continue;
         }
-        unlinkat(modfd, "update", 0);
-        if (faccessat(modfd, "disable", F_OK, 0) != 0)
-            module_list.emplace_back(entry->d_name);
-    });
+        if (it->flags & MODULE_UPDATE) {
+            unlinkat(dfd, (it->name + "/update").data(), 0);
+            it->flags &= ~MODULE_UPDATE;
+        }
+        ++it;
+    }
+    close(dfd);
 }
 
 void handle_modules() {
+    trace_span span(__FUNCTION__);
     prepare_modules();
     collect_modules();
     exec_module_scripts("post-fs-data");
 
     // Recollect modules (module scripts could remove itself)
-    module_list.clear();
     collect_modules();
 }
 
+static void rm_trash() {
+    trace_span span("remove_trash_modules");
+    rm_rf(MODULETRASH);
+}
+
+void remove_trash_modules() {
+    if (access(MODULETRASH, F_OK) == 0)
+        new_daemon_thread(&rm_trash);
+}
+
 void disable_modules() {
-    foreach_module([](int, auto, int modfd) {
-        close(xopenat(modfd, "disable", O_RDONLY | O_CREAT | O_CLOEXEC, 0));
-    });
+    mutex_guard lock(inventory_lock);
+    refresh_modules();
+    for (auto &m : module_list) {
+        auto disable = MODULEROOT "/"s + m.name + "/disable";
+        close(xopen(disable.data(), O_RDONLY | O_CREAT | O_CLOEXEC, 0));
+    }
 }
 
 void remove_modules() {
-    foreach_module([](int, dirent *entry, int) {
-        auto uninstaller = MODULEROOT + "/"s + entry->d_name + "/uninstall.sh";
-        if (access(uninstaller.data(), F_OK) == 0)
+    mutex_guard lock(inventory_lock);
+    refresh_modules();
+    for (auto &m : module_list) {
+        if (m.flags & MODULE_UNINSTALL) {
+            auto uninstaller = MODULEROOT "/"s + m.name + "/uninstall.sh";
             exec_script(uninstaller.data());
-    });
+        }
+    }
     rm_rf(MODULEROOT);
 }
 
 void exec_module_scripts(const char *stage) {
-    exec_module_scripts(stage, module_list);
+    auto mods = module_snapshot();
+    exec_module_scripts(stage, mods);
 }
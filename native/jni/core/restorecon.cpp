@@ -1,4 +1,7 @@
+#include <sys/xattr.h>
 #include <string_view>
+#include <vector>
+#include <algorithm>
 
 #include <magisk.hpp>
 #include <selinux.hpp>
@@ -13,56 +16,83 @@ using namespace std;
 #define MAGISK_CON  "u:object_r:" SEPOL_FILE_TYPE ":s0"
 #define EXEC_CON    "u:object_r:" SEPOL_EXEC_TYPE ":s0"
 
-static void restore_syscon(int dirfd) {
-    struct dirent *entry;
-    DIR *dir;
-    char *con;
+// Relabel an entry without opening it, the context is compared in a stack buffer
+using relabel_fn = void(*)(int dirfd, const char *name, unsigned char type);
 
-    if (fgetfilecon(dirfd, &con) >= 0) {
-        if (strlen(con) == 0 || strcmp(con, UNLABEL_CON) == 0)
-            fsetfilecon(dirfd, SYSTEM_CON);
-        freecon(con);
-    }
+static ssize_t getcon_at(int dirfd, const char *name, char *path, char *con, size_t len) {
+    snprintf(path, PATH_MAX, "/proc/self/fd/%d/%s", dirfd, name);
+    ssize_t sz = lgetxattr(path, XATTR_NAME_SELINUX, con, len - 1);
+    con[sz < 0 ? 0 : sz] = '\0';
+    return sz;
+}
 
-    dir = xfdopendir(dirfd);
-    while ((entry = xreaddir(dir))) {
-        int fd = openat(dirfd, entry->d_name, O_RDONLY | O_CLOEXEC);
+static void relabel_syscon(int dirfd, const char *name, unsigned char type) {
+    if (type != DT_DIR && type != DT_REG && type != DT_LNK)
+        return;
+    char path[PATH_MAX];
+    char con[128];
+    getcon_at(dirfd, name, path, con, sizeof(con));
+    if (con[0] == '\0' || strcmp(con, UNLABEL_CON) == 0)
+        lsetfilecon(path, SYSTEM_CON);
+}
+
+static void relabel_magiskcon(int dirfd, const char *name, unsigned char type) {
+    if (type == DT_UNKNOWN)
+        return;
+    char path[PATH_MAX];
+    char con[128];
+    getcon_at(dirfd, name, path, con, sizeof(con));
+    if (strcmp(con, MAGISK_CON) != 0)
+        lsetfilecon(path, MAGISK_CON);
+    // Only write the inode when the owner is actually wrong
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_uid != 0 || st.st_gid != 0)
+        fchownat(dirfd, name, 0, 0, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Walk a directory tree, dirfd is consumed. Every entry is checked on every
+ * boot: a change deep in a tree does not touch the ctime or mtime of its
+ * ancestors, so no per-tree stamp can tell that a subtree is unchanged
+ * without walking it anyway. */
+static void restore_dir(int dirfd, relabel_fn fn) {
+    auto dir = xopen_dir(dirfd);
+    if (!dir) {
+        close(dirfd);
+        return;
+    }
+    for (dirent *entry; (entry = xreaddir(dir.get()));) {
+        fn(dirfd, entry->d_name, entry->d_type);
         if (entry->d_type == DT_DIR) {
-            restore_syscon(fd);
-        } else if (entry->d_type == DT_REG) {
-            if (fgetfilecon(fd, &con) >= 0) {
-                if (con[0] == '\0' || strcmp(con, UNLABEL_CON) == 0)
-                    fsetfilecon(fd, SYSTEM_CON);
-                freecon(con);
-            }
-        } else if (entry->d_type == DT_LNK) {
-            getfilecon_at(dirfd, entry->d_name, &con);
-            if (con[0] == '\0' || strcmp(con, UNLABEL_CON) == 0)
-                setfilecon_at(dirfd, entry->d_name, con);
-            freecon(con);
+            int fd = openat(dirfd, entry->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd >= 0)
+                restore_dir(fd, fn);
         }
-        close(fd);
     }
 }
 
-static void restore_magiskcon(int dirfd) {
-    struct dirent *entry;
-    DIR *dir;
+struct restore_task {
+    int fd;
+    relabel_fn fn;
+};
 
-    fsetfilecon(dirfd, MAGISK_CON);
-    fchown(dirfd, 0, 0);
+struct restore_worker {
+    pthread_t thread;
+    vector<restore_task> *tasks;
+    atomic<size_t> *next;
+};
 
-    dir = xfdopendir(dirfd);
-    while ((entry = xreaddir(dir))) {
-        int fd = xopenat(dirfd, entry->d_name, O_RDONLY | O_CLOEXEC);
-        if (entry->d_type == DT_DIR) {
-            restore_magiskcon(fd);
-        } else if (entry->d_type) {
-            fsetfilecon(fd, MAGISK_CON);
-            fchown(fd, 0, 0);
-        }
-        close(fd);
+static void *restore_thread(void *arg) {
+    auto w = static_cast<restore_worker *>(arg);
+    for (size_t i; (i = (*w->next)++) < w->tasks->size();) {
+        auto &t = (*w->tasks)[i];
+        restore_dir(t.fd, t.fn);
     }
+    return nullptr;
+}
+
+static void add_task(vector<restore_task> &tasks, int fd, relabel_fn fn) {
+    if (fd >= 0)
+        tasks.push_back({ .fd = fd, .fn = fn });
 }
 
 void restorecon() {
@@ -70,13 +100,42 @@ void restorecon() {
     if (write(fd, ADB_CON, sizeof(ADB_CON)) >= 0)
         lsetfilecon(SECURE_DIR, ADB_CON);
     close(fd);
+
+    vector<restore_task> tasks;
+
+    // Handle the top level of modules here, each module is an independent subtree
     lsetfilecon(MODULEROOT, SYSTEM_CON);
-    fd = xopen(MODULEROOT, O_RDONLY | O_CLOEXEC);
-    restore_syscon(fd);
-    close(fd);
+    if (auto dir = open_dir(MODULEROOT); dir) {
+        int dfd = dirfd(dir.get());
+        for (dirent *entry; (entry = xreaddir(dir.get()));) {
+            relabel_syscon(dfd, entry->d_name, entry->d_type);
+            if (entry->d_type == DT_DIR) {
+                add_task(tasks, openat(dfd, entry->d_name,
+                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC), relabel_syscon);
+            }
+        }
+    }
+
     fd = xopen(DATABIN, O_RDONLY | O_CLOEXEC);
-    restore_magiskcon(fd);
-    close(fd);
+    fsetfilecon(fd, MAGISK_CON);
+    fchown(fd, 0, 0);
+    add_task(tasks, fd, relabel_magiskcon);
+
+    atomic<size_t> next = 0;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t num = std::min<size_t>(std::max(cpus, 1L), tasks.size());
+    vector<restore_worker> workers(num);
+    for (auto &w : workers) {
+        w.tasks = &tasks;
+        w.next = &next;
+    }
+    // Run the first worker on the current thread
+    for (size_t i = 1; i < num; ++i)
+        xpthread_create(&workers[i].thread, nullptr, restore_thread, &workers[i]);
+    if (num)
+        restore_thread(&workers[0]);
+    for (size_t i = 1; i < num; ++i)
+        pthread_join(workers[i].thread, nullptr);
 }
 
 void restore_tmpcon() {
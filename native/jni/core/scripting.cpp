@@ -1,10 +1,18 @@
 #include <string>
 #include <vector>
+#include <map>
+#include <deque>
+#include <algorithm>
 #include <sys/wait.h>
+#include <sys/signalfd.h>
+#include <sys/resource.h>
+#include <poll.h>
 
 #include <magisk.hpp>
 #include <utils.hpp>
 #include <selinux.hpp>
+#include <db.hpp>
+#include <socket.hpp>
 
 #include "core.hpp"
 
@@ -26,7 +34,208 @@ static void set_script_env() {
     setenv("PATH", new_path, 1);
 };
 
+/*****************
+ * Script Runner *
+ *****************/
+
+/* A small process forked once from the daemon, with the script environment
+ * already set up. Clients connect through a socket pair whose end is passed
+ * over the control socket, send script paths, and receive a START message
+ * once the script is forked and an EXIT message once it is reaped. The
+ * runner is single threaded, so the environment is set up once instead of
+ * calling setenv() in a fork of the multi-threaded daemon, and wait4() gives
+ * the CPU time of every script. It is not meant to be faster: exec of the
+ * shell dominates the cost, which is the same either way. Each script still
+ * gets a fresh shell, since scripts are free to exit, trap or change the
+ * shell state, so a reusable shell server is not an option. */
+
+struct runner_msg {
+    enum : int { START, EXIT } type;
+    int pid;
+    int code;     /* exit code, -1 if killed */
+    int cpu_ms;   /* user + system CPU time */
+};
+
+struct runner_proc {
+    int client;
+    string path;
+};
+
+static int runner_ctl = -1;
+static bool runner_enabled = false;
+static pthread_mutex_t runner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Clients may detach at any time, which must not kill the runner with SIGPIPE
+static bool send_msg(int client, const runner_msg &msg) {
+    return send(client, &msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg);
+}
+
+static void reap_scripts(map<int, runner_proc> &procs) {
+    int status;
+    rusage ru;
+    for (int pid; (pid = wait4(-1, &status, WNOHANG, &ru)) > 0;) {
+        auto it = procs.find(pid);
+        if (it == procs.end())
+            continue;
+        runner_msg msg {
+            .type = runner_msg::EXIT,
+            .pid = pid,
+            .code = WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+            .cpu_ms = static_cast<int>(
+                    (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+                    (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000)
+        };
+        // Nobody is waiting, report here
+        if (it->second.client < 0 || !send_msg(it->second.client, msg))
+            LOGI("runner: [%s] exit=[%d] cpu=[%dms]\n", it->second.path.data(), msg.code, msg.cpu_ms);
+        procs.erase(it);
+    }
+}
+
+[[noreturn]] static void script_runner(int ctl) {
+    set_script_env();
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    map<int, runner_proc> procs;
+    vector<pollfd> pfds = { { .fd = ctl, .events = POLLIN }, { .fd = sfd, .events = POLLIN } };
+    for (;;) {
+        if (poll(pfds.data(), pfds.size(), -1) <= 0)
+            continue;
+        if (pfds[1].revents) {
+            signalfd_siginfo si;
+            read(sfd, &si, sizeof(si));
+            reap_scripts(procs);
+        }
+        if (pfds[0].revents) {
+            int fd = recv_fd(ctl);
+            if (fd < 0)
+                // Daemon is gone
+                exit(0);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            pfds.push_back({ .fd = fd, .events = POLLIN });
+        }
+        for (auto it = pfds.begin() + 2; it != pfds.end();) {
+            if (it->revents == 0) {
+                ++it;
+                continue;
+            }
+            int client = it->fd;
+            string path;
+            int len;
+            if (read(client, &len, sizeof(len)) == sizeof(len) && len > 0 && len < PATH_MAX) {
+                path.resize(len);
+                if (xxread(client, path.data(), len) != len)
+                    path.clear();
+            }
+            if (path.empty()) {
+                // Client disconnected, scripts keep running
+                for (auto &[_, p] : procs) {
+                    if (p.client == client)
+                        p.client = -1;
+                }
+                close(client);
+                it = pfds.erase(it);
+                continue;
+            }
+            runner_msg msg { .type = runner_msg::START, .pid = fork() };
+            if (msg.pid == 0) {
+                // Unblock all signals
+                sigfillset(&mask);
+                sigprocmask(SIG_UNBLOCK, &mask, nullptr);
+                execl(bbpath(), "sh", path.data(), nullptr);
+                PLOGE("exec %s", path.data());
+                _exit(1);
+            }
+            if (msg.pid > 0)
+                procs[msg.pid] = { client, std::move(path) };
+            if (!send_msg(client, msg) && msg.pid > 0)
+                // Client detached (EPIPE), report the exit here instead
+                procs[msg.pid].client = -1;
+            ++it;
+        }
+    }
+}
+
+static void fork_runner() {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return;
+    if (fork_dont_care() == 0) {
+        close(fds[0]);
+        script_runner(fds[1]);
+    }
+    close(fds[1]);
+    runner_ctl = fds[0];
+}
+
+void start_script_runner() {
+    mutex_guard lock(runner_lock);
+    runner_enabled = true;
+    if (runner_ctl < 0)
+        fork_runner();
+}
+
+// Return a new connection to the runner, or -1 if unavailable
+static int connect_runner() {
+    mutex_guard lock(runner_lock);
+    if (!runner_enabled)
+        return -1;
+    pollfd pfd = { .fd = runner_ctl, .events = POLLOUT };
+    if (runner_ctl < 0 || poll(&pfd, 1, 0) < 0 || (pfd.revents & (POLLHUP | POLLERR))) {
+        // Restart the runner if it died
+        if (runner_ctl >= 0)
+            close(runner_ctl);
+        runner_ctl = -1;
+        fork_runner();
+        if (runner_ctl < 0)
+            return -1;
+    }
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+    send_fd(runner_ctl, fds[1]);
+    close(fds[1]);
+    return fds[0];
+}
+
+// Wait for the next message, return false on timeout (ms, -1 for infinite) or error
+static bool read_runner(int fd, long timeout, runner_msg &msg) {
+    pollfd pfd = { .fd = fd, .events = POLLIN };
+    if (xpoll(&pfd, 1, timeout) <= 0)
+        return false;
+    return xxread(fd, &msg, sizeof(msg)) == sizeof(msg);
+}
+
+// Run a script through the runner and wait until it exits
+static bool run_script(int fd, const char *script, long timeout, runner_msg &msg) {
+    int64_t deadline = trace_now() + timeout * 1000000;
+    write_string(fd, script);
+    int pid = -1;
+    for (;;) {
+        long wait = timeout < 0 ? -1 : std::max<int64_t>((deadline - trace_now()) / 1000000, 0);
+        if (!read_runner(fd, wait, msg))
+            return false;
+        if (msg.type == runner_msg::START) {
+            if ((pid = msg.pid) < 0)
+                return false;
+        } else if (msg.pid == pid) {
+            return true;
+        }
+    }
+}
+
 void exec_script(const char *script) {
+    if (int fd = connect_runner(); fd >= 0) {
+        runner_msg msg;
+        if (run_script(fd, script, -1, msg))
+            LOGI("[%s] exit=[%d] cpu=[%dms]\n", script, msg.code, msg.cpu_ms);
+        close(fd);
+        return;
+    }
     exec_t exec {
         .pre_exec = set_script_env,
         .fork = fork_no_orphan
@@ -36,116 +245,373 @@ void exec_script(const char *script) {
 
 static timespec pfs_timeout;
 
-#define PFS_SETUP() \
-if (pfs) { \
-    if (int pid = xfork()) { \
-        if (pid < 0) \
-            return; \
-        /* In parent process, simply wait for child to finish */ \
-        waitpid(pid, nullptr, 0); \
-        return; \
-    } \
-    timer_pid = xfork(); \
-    if (timer_pid == 0) { \
-        /* In timer process, count down */ \
-        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &pfs_timeout, nullptr); \
-        exit(0); \
-    } \
-}
-
-#define PFS_WAIT() \
-if (pfs) { \
-    /* If we ran out of time, don't block */ \
-    if (timer_pid < 0) \
-        continue; \
-    if (int pid = waitpid(-1, nullptr, 0); pid == timer_pid) { \
-        LOGW("* post-fs-data scripts blocking phase timeout\n"); \
-        timer_pid = -1; \
-    } \
-}
-
-#define PFS_DONE() \
-if (pfs) { \
-    if (timer_pid > 0) \
-        kill(timer_pid, SIGKILL); \
-    exit(0); \
+// Remaining time of the post-fs-data blocking phase in ms
+static long pfs_remaining() {
+    int64_t end = pfs_timeout.tv_sec * 1000000000LL + pfs_timeout.tv_nsec;
+    return std::max<int64_t>((end - trace_now()) / 1000000, 0);
+}
+
+// Return if a > b
+static bool timespec_larger(timespec *a, timespec *b) {
+    if (a->tv_sec != b->tv_sec)
+        return a->tv_sec > b->tv_sec;
+    return a->tv_nsec > b->tv_nsec;
+}
+
+/***************************
+ * Module Script Scheduler *
+ ***************************/
+
+struct script_job {
+    string module;
+    string path;
+    vector<string> after;  /* Modules that have to finish first */
+    int pid = -1;
+    int64_t start = 0;
+    enum { PENDING, RUNNING, DONE } state = PENDING;
+};
+
+static int max_script_jobs() {
+    db_settings dbs;
+    get_db_settings(dbs, SCRIPT_JOBS);
+    int jobs = dbs[SCRIPT_JOBS];
+    if (jobs <= 0)
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    return jobs > 0 ? jobs : 1;
+}
+
+static void collect_script_jobs(const char *stage, vector<module_info> &module_list,
+                                vector<script_job> &jobs) {
+    unsigned flag = stage == "service"sv ? MODULE_SERVICE : MODULE_POST_FS;
+    char path[4096];
+    for (auto &m : module_list) {
+        if ((m.flags & MODULE_DISABLE) || !(m.flags & flag))
+            continue;
+        sprintf(path, MODULEROOT "/%s/%s.sh", m.name.data(), stage);
+        load_module_prop(m);
+        auto &job = jobs.emplace_back();
+        job.module = m.name;
+        job.path = path;
+        job.after = m.after;
+    }
+
+    // Only keep ordering constraints on modules that actually run in this stage
+    for (auto &job : jobs) {
+        job.after.erase(remove_if(job.after.begin(), job.after.end(), [&](const string &dep) {
+            return dep == job.module || none_of(jobs.begin(), jobs.end(),
+                    [&](const script_job &j) { return j.module == dep; });
+        }), job.after.end());
+    }
+}
+
+static bool job_ready(const script_job &job, const vector<script_job> &jobs) {
+    for (auto &dep : job.after) {
+        for (auto &j : jobs) {
+            if (j.module == dep && j.state != script_job::DONE)
+                return false;
+        }
+    }
+    return true;
+}
+
+static long elapsed_ms(const script_job &job) {
+    return (trace_now() - job.start) / 1000000;
+}
+
+static const char *job_file(const script_job &job) {
+    return strrchr(job.path.data(), '/') + 1;
+}
+
+// Send the span of a finished script back to the daemon
+static void trace_job(const script_job &job, int trace_fd) {
+    trace_event e{};
+    snprintf(e.name, sizeof(e.name), "%s: %s", job.module.data(), job_file(job));
+    e.tid = job.pid;
+    e.ts = job.start;
+    e.dur = trace_now() - job.start;
+    write(trace_fd, &e, sizeof(e));
+}
+
+/* Run all jobs with at most max_jobs scripts in parallel. A script running
+ * longer than MODULE_SCRIPT_MAX_TIME is left running in the background and
+ * no longer holds back other scripts or modules ordered after it. */
+static void run_script_jobs(vector<script_job> &jobs, const char *stage, int max_jobs,
+                            int runner, int trace_fd) {
+    // Jobs sent to the runner, waiting for their START message
+    deque<script_job *> starting;
+    size_t done = 0;
+    int running = 0;
+    while (done < jobs.size()) {
+        for (auto &job : jobs) {
+            if (running >= max_jobs)
+                break;
+            if (job.state != script_job::PENDING || !job_ready(job, jobs))
+                continue;
+            LOGI("%s: exec [%s.sh]\n", job.module.data(), stage);
+            job.start = trace_now();
+            write_string(runner, job.path);
+            starting.push_back(&job);
+            job.state = script_job::RUNNING;
+            ++running;
+        }
+
+        if (running == 0) {
+            if (done == jobs.size())
+                break;
+            // Nothing can start: ordering constraints form a cycle
+            LOGW("* Module %s scripts have circular ordering, ignore constraints\n", stage);
+            for (auto &job : jobs)
+                job.after.clear();
+            continue;
+        }
+
+        // Wait until a script exits or the oldest running script times out
+        long wait = MODULE_SCRIPT_MAX_TIME * 1000L;
+        for (auto &job : jobs) {
+            if (job.state == script_job::RUNNING)
+                wait = std::min(wait, MODULE_SCRIPT_MAX_TIME * 1000L - elapsed_ms(job));
+        }
+        pollfd pfd = { .fd = runner, .events = POLLIN };
+        if (xpoll(&pfd, 1, std::max(wait, 0L)) > 0) {
+            runner_msg msg;
+            if (xxread(runner, &msg, sizeof(msg)) != sizeof(msg)) {
+                LOGE("* Lost connection to script runner\n");
+                return;
+            }
+            if (msg.type == runner_msg::START) {
+                auto job = starting.front();
+                starting.pop_front();
+                job->pid = msg.pid;
+                if (msg.pid < 0) {
+                    job->state = script_job::DONE;
+                    --running;
+                    ++done;
+                }
+            } else {
+                for (auto &job : jobs) {
+                    if (job.pid == msg.pid && job.state == script_job::RUNNING) {
+                        LOGI("%s: [%s.sh] exit=[%d] time=[%ldms] cpu=[%dms]\n", job.module.data(),
+                             stage, msg.code, elapsed_ms(job), msg.cpu_ms);
+                        trace_job(job, trace_fd);
+                        job.state = script_job::DONE;
+                        --running;
+                        ++done;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (auto &job : jobs) {
+            if (job.state == script_job::RUNNING && job.pid > 0 &&
+                elapsed_ms(job) >= MODULE_SCRIPT_MAX_TIME * 1000L) {
+                LOGW("%s: [%s.sh] timeout, continue in background\n", job.module.data(), stage);
+                trace_job(job, trace_fd);
+                job.state = script_job::DONE;
+                --running;
+                ++done;
+            }
+        }
+    }
+}
+
+// Return true if the scheduler is done before timeout (ms, -1 for infinite)
+static bool read_script_traces(int fd, long timeout) {
+    int64_t deadline = trace_now() + timeout * 1000000;
+    for (;;) {
+        pollfd pfd = { .fd = fd, .events = POLLIN };
+        int wait = timeout < 0 ? -1 : std::max<int64_t>((deadline - trace_now()) / 1000000, 0);
+        if (xpoll(&pfd, 1, wait) <= 0)
+            return false;
+        trace_event e;
+        if (read(fd, &e, sizeof(e)) != sizeof(e))
+            return true;
+        trace_record(e);
+    }
+}
+
+/* Without the script runner, fork and exec scripts one at a time in
+ * dependency order. A script running longer than MODULE_SCRIPT_MAX_TIME is
+ * left running and the next one is started. */
+static void run_jobs_direct(vector<script_job> &jobs, const char *stage, int trace_fd) {
+    for (size_t done = 0; done < jobs.size();) {
+        script_job *job = nullptr;
+        for (auto &j : jobs) {
+            if (j.state == script_job::PENDING && job_ready(j, jobs)) {
+                job = &j;
+                break;
+            }
+        }
+        if (job == nullptr) {
+            LOGW("* Module %s scripts have circular ordering, ignore constraints\n", stage);
+            for (auto &j : jobs)
+                j.after.clear();
+            continue;
+        }
+        LOGI("%s: exec [%s]\n", job->module.data(), job_file(*job));
+        exec_t exec {
+            .pre_exec = set_script_env
+        };
+        job->start = trace_now();
+        job->pid = exec_command(exec, BBEXEC_CMD, job->path.data());
+        for (int status; job->pid > 0;) {
+            if (waitpid(job->pid, &status, WNOHANG) != 0) {
+                LOGI("%s: [%s] exit=[%d] time=[%ldms]\n", job->module.data(), job_file(*job),
+                     WIFEXITED(status) ? WEXITSTATUS(status) : -1, elapsed_ms(*job));
+                break;
+            }
+            if (elapsed_ms(*job) >= MODULE_SCRIPT_MAX_TIME * 1000L) {
+                LOGW("%s: [%s] timeout, continue in background\n", job->module.data(), job_file(*job));
+                break;
+            }
+            usleep(10000);
+        }
+        trace_job(*job, trace_fd);
+        job->state = script_job::DONE;
+        ++done;
+    }
+}
+
+// Wait for the scheduler to close the trace pipe, blocking for at most budget ms in pfs mode
+static void collect_script_traces(int fd, bool pfs, long budget) {
+    if (pfs && read_script_traces(fd, budget)) {
+        close(fd);
+        return;
+    }
+    if (pfs)
+        LOGW("* post-fs-data scripts blocking phase timeout\n");
+    new_daemon_thread([=] {
+        read_script_traces(fd, -1);
+        close(fd);
+    });
+}
+
+// Fallback when the script runner is unavailable, this only costs speed
+static void exec_jobs_direct(vector<script_job> &jobs, const char *stage, bool pfs, long budget) {
+    if (jobs.empty())
+        return;
+    int fds[2];
+    if (xpipe2(fds, O_CLOEXEC) < 0)
+        return;
+    if (fork_dont_care() == 0) {
+        close(fds[0]);
+        run_jobs_direct(jobs, stage, fds[1]);
+        exit(0);
+    }
+    close(fds[1]);
+    collect_script_traces(fds[0], pfs, budget);
 }
 
 void exec_common_scripts(const char *stage) {
     LOGI("* Running %s.d scripts\n", stage);
     char path[4096];
+    char span_name[48];
+    snprintf(span_name, sizeof(span_name), "%s.d scripts", stage);
+    trace_span span(span_name);
     char *name = path + sprintf(path, SECURE_DIR "/%s.d", stage);
     auto dir = xopen_dir(path);
     if (!dir) return;
 
     bool pfs = stage == "post-fs-data"sv;
-    int timer_pid = -1;
     if (pfs) {
         // Setup timer
         clock_gettime(CLOCK_MONOTONIC, &pfs_timeout);
         pfs_timeout.tv_sec += POST_FS_DATA_SCRIPT_MAX_TIME;
     }
-    PFS_SETUP()
 
     *(name++) = '/';
     int dfd = dirfd(dir.get());
+
+    int fd = connect_runner();
+    if (fd < 0) {
+        LOGW("* Script runner unavailable, exec scripts directly\n");
+        vector<script_job> jobs;
+        for (dirent *entry; (entry = xreaddir(dir.get()));) {
+            if (entry->d_type != DT_REG || faccessat(dfd, entry->d_name, X_OK, 0) != 0)
+                continue;
+            strcpy(name, entry->d_name);
+            auto &job = jobs.emplace_back();
+            job.module = stage + ".d"s;
+            job.path = path;
+        }
+        exec_jobs_direct(jobs, stage, pfs, pfs_remaining());
+        return;
+    }
+
     for (dirent *entry; (entry = xreaddir(dir.get()));) {
         if (entry->d_type == DT_REG) {
             if (faccessat(dfd, entry->d_name, X_OK, 0) != 0)
                 continue;
             LOGI("%s.d: exec [%s]\n", stage, entry->d_name);
             strcpy(name, entry->d_name);
-            exec_t exec {
-                .pre_exec = set_script_env,
-                .fork = pfs ? xfork : fork_dont_care
-            };
-            exec_command(exec, BBEXEC_CMD, path);
-            PFS_WAIT()
+            if (!pfs) {
+                // The runner reports the result once the script exits
+                write_string(fd, path);
+                continue;
+            }
+            runner_msg msg;
+            if (run_script(fd, path, pfs_remaining(), msg)) {
+                LOGI("%s.d: [%s] exit=[%d] cpu=[%dms]\n",
+                     stage, entry->d_name, msg.code, msg.cpu_ms);
+            } else {
+                // If we ran out of time, don't block
+                LOGW("* post-fs-data scripts blocking phase timeout\n");
+                pfs = false;
+            }
         }
     }
-
-    PFS_DONE()
-}
-
-// Return if a > b
-static bool timespec_larger(timespec *a, timespec *b) {
-    if (a->tv_sec != b->tv_sec)
-        return a->tv_sec > b->tv_sec;
-    return a->tv_nsec > b->tv_nsec;
+    close(fd);
 }
 
-void exec_module_scripts(const char *stage, const vector<string> &module_list) {
+void exec_module_scripts(const char *stage, vector<module_info> &module_list) {
     LOGI("* Running module %s scripts\n", stage);
-    if (module_list.empty())
-        return;
+
+    char span_name[48];
+    snprintf(span_name, sizeof(span_name), "module %s scripts", stage);
+    trace_span span(span_name);
 
     bool pfs = stage == "post-fs-data"sv;
+    long budget = 0;
     if (pfs) {
         timespec now{};
         clock_gettime(CLOCK_MONOTONIC, &now);
         // If we had already timed out, treat it as service mode
         if (timespec_larger(&now, &pfs_timeout))
             pfs = false;
+        else
+            budget = (pfs_timeout.tv_sec - now.tv_sec) * 1000L +
+                     (pfs_timeout.tv_nsec - now.tv_nsec) / 1000000L;
     }
-    int timer_pid = -1;
-    PFS_SETUP()
 
-    char path[4096];
-    for (auto &m : module_list) {
-        const char* module = m.data();
-        sprintf(path, MODULEROOT "/%s/%s.sh", module, stage);
-        if (access(path, F_OK) == -1)
-            continue;
-        LOGI("%s: exec [%s.sh]\n", module, stage);
-        exec_t exec {
-            .pre_exec = set_script_env,
-            .fork = pfs ? xfork : fork_dont_care
-        };
-        exec_command(exec, BBEXEC_CMD, path);
-        PFS_WAIT()
+    vector<script_job> jobs;
+    collect_script_jobs(stage, module_list, jobs);
+    if (jobs.empty())
+        return;
+    int max_jobs = max_script_jobs();
+    int runner = connect_runner();
+    if (runner < 0) {
+        LOGW("* Script runner unavailable, exec scripts directly\n");
+        exec_jobs_direct(jobs, stage, pfs, budget);
+        return;
     }
 
-    PFS_DONE()
+    // The scheduler runs in its own process, scripts are launched by the runner.
+    // Script spans are sent back through a pipe, which is closed once all
+    // scripts are done. In post-fs-data mode, block until then or until the
+    // time budget runs out.
+    int fds[2];
+    if (xpipe2(fds, O_CLOEXEC) < 0) {
+        close(runner);
+        return;
+    }
+    if (fork_dont_care() == 0) {
+        close(fds[0]);
+        run_script_jobs(jobs, stage, max_jobs, runner, fds[1]);
+        exit(0);
+    }
+    close(runner);
+    close(fds[1]);
+    collect_script_traces(fds[0], pfs, budget);
 }
 
 constexpr char install_script[] = R"EOF(
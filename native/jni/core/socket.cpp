@@ -1,5 +1,7 @@
 #include <fcntl.h>
 #include <endian.h>
+#include <limits.h>
+#include <sys/ioctl.h>
 
 #include <socket.hpp>
 #include <utils.hpp>
@@ -180,3 +182,73 @@ void write_string(int fd, string_view str) {
     write_int(fd, str.size());
     xwrite(fd, str.data(), str.size());
 }
+
+/*
+ * Frames are a fixed header followed by the payload. Batches of frames
+ * are sent with a single sendmsg per IOV_MAX iovecs.
+ */
+
+struct frame_hdr {
+    uint32_t len;
+    uint32_t id;
+    int32_t code;
+};
+
+bool read_frame(int fd, daemon_frame &frame, uint32_t max_len) {
+    frame_hdr hdr;
+    // EOF before a header is the normal end of a connection
+    ssize_t len = read(fd, &hdr, sizeof(hdr));
+    if (len <= 0)
+        return false;
+    if (len < sizeof(hdr) && xxread(fd, (char *) &hdr + len, sizeof(hdr) - len) != sizeof(hdr) - len)
+        return false;
+    // The length comes from the peer, never trust it
+    if (hdr.len > max_len) {
+        LOGW("Frame too large: %u\n", hdr.len);
+        return false;
+    }
+    frame.id = hdr.id;
+    frame.code = hdr.code;
+    frame.data.resize(hdr.len);
+    return xxread(fd, frame.data.data(), hdr.len) == hdr.len;
+}
+
+bool frame_ready(int fd) {
+    frame_hdr hdr;
+    int avail;
+    if (ioctl(fd, FIONREAD, &avail) < 0 || avail < (int) sizeof(hdr))
+        return false;
+    if (recv(fd, &hdr, sizeof(hdr), MSG_PEEK | MSG_DONTWAIT) != sizeof(hdr))
+        return false;
+    return avail - sizeof(hdr) >= hdr.len;
+}
+
+bool write_frames(int fd, const vector<daemon_frame> &frames) {
+    vector<frame_hdr> hdrs;
+    hdrs.reserve(frames.size());
+    vector<iovec> iov;
+    iov.reserve(frames.size() * 2);
+    for (auto &f : frames) {
+        auto &hdr = hdrs.emplace_back();
+        hdr = { static_cast<uint32_t>(f.data.size()), f.id, f.code };
+        iov.push_back({ &hdr, sizeof(hdr) });
+        if (!f.data.empty())
+            iov.push_back({ (void *) f.data.data(), f.data.size() });
+    }
+    for (size_t i = 0; i < iov.size();) {
+        msghdr msg{};
+        msg.msg_iov = &iov[i];
+        msg.msg_iovlen = std::min<size_t>(iov.size() - i, IOV_MAX);
+        ssize_t len = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (len < 0)
+            return false;
+        // Skip over what was sent, resume from partial writes
+        for (; i < iov.size() && len >= (ssize_t) iov[i].iov_len; ++i)
+            len -= iov[i].iov_len;
+        if (len > 0) {
+            iov[i].iov_base = (char *) iov[i].iov_base + len;
+            iov[i].iov_len -= len;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,71 @@
+#include <unistd.h>
+
+#include <utils.hpp>
+#include <socket.hpp>
+
+#include "core.hpp"
+
+using namespace std;
+
+// Fixed size ring buffer, oldest events are overwritten
+#define TRACE_BUF_SIZE 1024
+
+static trace_event events[TRACE_BUF_SIZE];
+static uint32_t event_idx = 0;
+// Records are multiple words, guard slots so a dump never sees torn events
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int64_t trace_now() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void trace_record(const trace_event &e) {
+    mutex_guard lock(event_lock);
+    events[event_idx++ % TRACE_BUF_SIZE] = e;
+}
+
+void trace_record(const char *name, int64_t ts, int64_t dur) {
+    trace_event e;
+    strlcpy(e.name, name, sizeof(e.name));
+    e.tid = gettid();
+    e.ts = ts;
+    e.dur = dur;
+    trace_record(e);
+}
+
+// Output all recorded events in Chrome trace event format
+void dump_trace(int client) {
+    // Snapshot the ring and format outside of the lock
+    vector<trace_event> snapshot;
+    {
+        mutex_guard lock(event_lock);
+        uint32_t end = event_idx;
+        uint32_t begin = end > TRACE_BUF_SIZE ? end - TRACE_BUF_SIZE : 0;
+        snapshot.reserve(end - begin);
+        for (uint32_t i = begin; i < end; ++i)
+            snapshot.push_back(events[i % TRACE_BUF_SIZE]);
+    }
+    int pid = getpid();
+
+    string out = R"({"displayTimeUnit":"ms","traceEvents":[)";
+    char buf[128];
+    for (auto &e : snapshot) {
+        if (&e != snapshot.data())
+            out += ',';
+        out += R"({"ph":"X","name":")";
+        for (const char *c = e.name; c < e.name + sizeof(e.name) && *c; ++c) {
+            if (*c == '"' || *c == '\\')
+                out += '\\';
+            out += *c;
+        }
+        snprintf(buf, sizeof(buf), R"(","pid":%d,"tid":%d,"ts":%lld.%03d,"dur":%lld.%03d})",
+                 pid, e.tid, (long long) e.ts / 1000, (int) (e.ts % 1000),
+                 (long long) e.dur / 1000, (int) (e.dur % 1000));
+        out += buf;
+    }
+    out += "]}";
+    write_string(client, out);
+    close(client);
+}
@@ -25,9 +25,15 @@ enum : int {
     MAGISKHIDE,
     SQLITE_CMD,
     REMOVE_MODULES,
+    BOOT_TRACE,
+    MULTIPLEX,
+    SQLITE_QUERY,
     DAEMON_CODE_END,
 };
 
+// Version of the framed protocol used by MULTIPLEX connections
+#define MULTIPLEX_VERSION 1
+
 // Return codes for daemon
 enum : int {
     DAEMON_ERROR = -1,
@@ -54,6 +60,9 @@ void boot_complete(int client);
 void magiskhide_handler(int client, ucred *cred);
 void su_daemon_handler(int client, ucred *credential);
 
+// Superuser
+void clear_su_cache();
+
 // MagiskHide
 void auto_start_magiskhide(bool late_props);
 int stop_magiskhide();
@@ -2,6 +2,7 @@
 
 #include <sys/stat.h>
 #include <map>
+#include <memory>
 #include <string>
 #include <string_view>
 #include <functional>
@@ -40,16 +41,18 @@ protected:
 "multiuser_mode", \
 "mnt_ns", \
 "magiskhide", \
+"script_jobs", \
 })
 
-#define DB_SETTINGS_NUM 4
+#define DB_SETTINGS_NUM 5
 
 // Settings keys
 enum {
     ROOT_ACCESS = 0,
     SU_MULTIUSER_MODE,
     SU_MNT_NS,
-    HIDE_CONFIG
+    HIDE_CONFIG,
+    SCRIPT_JOBS
 };
 
 // Values for root_access
@@ -144,14 +147,80 @@ struct su_access {
 typedef std::map<std::string_view, std::string_view> db_row;
 typedef std::function<bool(db_row&)> db_row_cb;
 
+struct sqlite3_stmt;
+
+// Typed access to the current row of a prepared statement
+class db_cursor {
+public:
+    explicit db_cursor(sqlite3_stmt *stmt) : stmt(stmt) {}
+    int columns() const;
+    const char *name(int col) const;
+    int get_int(int col) const;
+    int64_t get_int64(int col) const;
+    std::string_view get_text(int col) const;
+    bool is_null(int col) const;
+private:
+    sqlite3_stmt *stmt;
+};
+typedef std::function<bool(const db_cursor&)> db_cursor_cb;
+
+// A value bound to a '?' parameter
+struct db_arg {
+    enum { INT, TEXT } type;
+    int64_t num;
+    std::string_view text;
+
+    db_arg(int v) : type(INT), num(v) {}
+    db_arg(int64_t v) : type(INT), num(v) {}
+    db_arg(const char *v) : type(TEXT), num(0), text(v) {}
+    db_arg(std::string_view v) : type(TEXT), num(0), text(v) {}
+};
+
+struct db_config {
+    db_settings settings;
+    db_strings strings;
+};
+
+std::shared_ptr<const db_config> get_db_config();
 int get_db_settings(db_settings &cfg, int key = -1);
 int get_db_strings(db_strings &str, int key = -1);
-int get_uid_policy(su_access &su, int uid);
+int get_uid_policy(su_access &su, int uid, time_t *until = nullptr);
 bool check_manager(std::string *pkg = nullptr);
 bool validate_manager(std::string &pkg, int userid, struct stat *st);
 void exec_sql(int client);
+
+/* Binary results for SQLITE_QUERY. The request is the SQL string followed by
+ * a row limit (-1 for none) and the number of rows to skip. Statements after
+ * the one reaching the limit are not executed. The reply is a sequence of
+ * records, all integers are native ints and strings are length prefixed:
+ *   SQL_HEADER: column count, column names  (before the first row of a statement)
+ *   SQL_ROW:    one string per column, NULL values have length -1
+ *   SQL_END:    0 on success, or 1 followed by the error message */
+enum : int {
+    SQL_END = 0,
+    SQL_HEADER,
+    SQL_ROW,
+};
+void stream_sql(int client);
 char *db_exec(const char *sql);
 char *db_exec(const char *sql, const db_row_cb &fn);
+char *db_query(const char *sql, std::initializer_list<db_arg> args,
+               const db_cursor_cb &fn = nullptr);
 bool db_err(char *e);
 
+// Rough classification of client SQL, by the leading keyword of each statement
+#define SQL_WRITE (1 << 0)  /* Not a plain SELECT */
+#define SQL_TXN   (1 << 1)  /* Manages transactions itself */
+int sql_flags(std::string_view sql);
+
+/* Writes issued while any db_batch is alive are committed together when the
+ * last one goes out of scope. As the database connection is shared, this
+ * includes writes from other threads in the meantime. */
+class db_batch {
+public:
+    db_batch();
+    ~db_batch();
+    db_batch(const db_batch &) = delete;
+};
+
 #define db_err_cmd(e, cmd) if (db_err(e)) { cmd; }
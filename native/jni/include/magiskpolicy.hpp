@@ -1,6 +1,8 @@
 #pragma once
 
 #include <stdlib.h>
+#include <string>
+#include <vector>
 #include <selinux.hpp>
 
 #define ALL nullptr
@@ -17,11 +19,26 @@ public:
     static sepolicy *from_split();
     static sepolicy *compile_split();
 
+    // SHA-256 of everything a compiled split policy patched with the rule
+    // files depends on. Empty if a precompiled policy is used instead.
+    static std::string split_digest(const std::vector<std::string> &rule_files);
+
     // External APIs
     bool to_file(c_str file);
     void parse_statement(c_str stmt);
     void load_rule_file(c_str file);
 
+    // Pre-tokenized rules: compile a rule file into a binary blob, which
+    // can be loaded without parsing. load_rule_blob() does not modify the
+    // policy if the blob is invalid or was not compiled from src.
+    static bool compile_rules(c_str in, c_str out);
+    bool load_rule_blob(c_str file, c_str src);
+
+    // Batch policy changes: re-indexing after adding types is deferred
+    // until the outermost commit(). Transactions can be nested.
+    void begin();
+    bool commit();
+
     // Operation on types
     bool type(c_str name, c_str attr);
     bool attribute(c_str name);
@@ -57,4 +74,6 @@ public:
 
 protected:
     policydb *db;
+    int txn_depth = 0;
+    bool types_dirty = false;
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <functional>
 
 int setprop(const char *name, const char *value, bool prop_svc = true);
@@ -8,4 +9,5 @@ std::string getprop(const char *name, bool persist = false);
 void getprops(void (*callback)(const char *, const char *, void *),
         void *cookie = nullptr, bool persist = false);
 int delprop(const char *name, bool persist = false);
+void setprops(const std::vector<std::pair<std::string, std::string>> &props, bool prop_svc = true);
 void load_prop_file(const char *filename, bool prop_svc = true);
@@ -3,6 +3,8 @@
 #include <sys/un.h>
 #include <sys/socket.h>
 #include <string_view>
+#include <vector>
+#include <cstdint>
 
 socklen_t setup_sockaddr(sockaddr_un *sun, const char *name);
 int socket_accept(int sockfd, int timeout);
@@ -16,3 +18,18 @@ void write_int_be(int fd, int val);
 std::string read_string(int fd);
 void read_string(int fd, std::string &str);
 void write_string(int fd, std::string_view str);
+
+// Framed messages for multiplexed daemon connections
+#define MAX_FRAME_SIZE (1 << 20)
+
+struct daemon_frame {
+    uint32_t id;
+    int code;           /* Request code, or status of the reply */
+    std::string data;
+};
+
+// Returns false on EOF, errors, or payloads larger than max_len
+bool read_frame(int fd, daemon_frame &frame, uint32_t max_len = MAX_FRAME_SIZE);
+// Whether a whole frame is already buffered and read_frame will not block
+bool frame_ready(int fd);
+bool write_frames(int fd, const std::vector<daemon_frame> &frames);
@@ -72,8 +72,11 @@ static void load_overlay_rc(const char *overlay) {
     }
 }
 
+#define SEPOL_CACHE ".sepolicy_cache"
+
 bool MagiskInit::patch_sepolicy(const char *file) {
     bool patch_init = false;
+    bool patch_rules = true;
     sepolicy *sepol = nullptr;
 
     if (access(SPLIT_PLAT_CIL, R_OK) == 0) {
@@ -93,21 +96,84 @@ bool MagiskInit::patch_sepolicy(const char *file) {
         mount_list.emplace_back(SELINUX_MNT);
     }
 
-    if (patch_init)
-        sepol = sepolicy::from_split();
-
-    sepol->magisk_rules();
-
     // Custom rules
+    vector<string> rule_files;
     if (!custom_rules_dir.empty()) {
         if (auto dir = xopen_dir(custom_rules_dir.data())) {
             for (dirent *entry; (entry = xreaddir(dir.get()));) {
+                // Skip the policy cache
+                if (entry->d_name[0] == '.')
+                    continue;
                 auto rule = custom_rules_dir + "/" + entry->d_name + "/sepolicy.rule";
-                if (xaccess(rule.data(), R_OK) == 0) {
-                    LOGD("Loading custom sepolicy patch: [%s]\n", rule.data());
-                    sepol->load_rule_file(rule.data());
-                }
+                if (xaccess(rule.data(), R_OK) == 0)
+                    rule_files.push_back(move(rule));
+            }
+        }
+        // Keep the result stable regardless of directory order
+        std::sort(rule_files.begin(), rule_files.end());
+    }
+
+    // Compiling the split policy is by far the most expensive step, cache
+    // the final patched policy in the rules directory so that it is removed
+    // together with the rules
+    string digest, cache;
+    if (patch_init && !custom_rules_dir.empty()) {
+        digest = sepolicy::split_digest(rule_files);
+        if (!digest.empty())
+            cache = custom_rules_dir + "/" SEPOL_CACHE "/policy";
+    }
+    if (!cache.empty()) {
+        char id[65] = {0};
+        if (int fd = open((cache + ".sha256").data(), O_RDONLY | O_CLOEXEC); fd >= 0) {
+            read(fd, id, 64);
+            close(fd);
+        }
+        if (digest == id && (sepol = sepolicy::from_file(cache.data()))) {
+            LOGD("sepol: using cached policy [%s]\n", cache.data());
+            // Already patched, nothing to write back
+            cache.clear();
+            patch_rules = false;
+        }
+    }
+
+    if (patch_rules) {
+        if (patch_init)
+            sepol = sepolicy::from_split();
+
+        sepol->begin();
+        sepol->magisk_rules();
+        for (auto &rule : rule_files) {
+            // Prefer rules compiled at module install time
+            auto blob = rule + ".bin";
+            if (access(blob.data(), R_OK) == 0) {
+                LOGD("Loading compiled sepolicy patch: [%s]\n", blob.data());
+                if (sepol->load_rule_blob(blob.data(), rule.data()))
+                    continue;
             }
+            LOGD("Loading custom sepolicy patch: [%s]\n", rule.data());
+            sepol->load_rule_file(rule.data());
+        }
+        sepol->commit();
+    }
+
+    if (!cache.empty()) {
+        // Invalidate first, only write the digest after the policy is complete
+        auto id = cache + ".sha256";
+        unlink(id.data());
+        xmkdirs((custom_rules_dir + "/" SEPOL_CACHE).data(), 0700);
+        int fd = -1;
+        if (sepol->to_file(cache.data())) {
+            // The policy has to be on disk before the digest vouches for it
+            int pfd = xopen(cache.data(), O_RDONLY | O_CLOEXEC);
+            if (pfd >= 0 && fsync(pfd) == 0)
+                fd = xopen(id.data(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+            if (pfd >= 0)
+                close(pfd);
+        }
+        if (fd >= 0) {
+            xwrite(fd, digest.data(), digest.length());
+            fsync(fd);
+            close(fd);
         }
     }
 
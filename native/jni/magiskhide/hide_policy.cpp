@@ -112,6 +112,8 @@ void hide_unmount(int pid) {
     parse_mnt("/proc/self/mounts", [&](mntent *mentry) {
         if (TMPFS_MNT(system) || TMPFS_MNT(vendor) || TMPFS_MNT(product) || TMPFS_MNT(system_ext))
             targets.emplace_back(mentry->mnt_dir);
+        else if (mentry->mnt_type == "overlay"sv && mentry->mnt_fsname == "magisk"sv)
+            targets.emplace_back(mentry->mnt_dir);
         return true;
     });
 
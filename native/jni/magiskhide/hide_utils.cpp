@@ -158,10 +158,8 @@ static int add_list(const char *pkg, const char *proc) {
             return HIDE_ITEM_EXIST;
 
     // Add to database
-    char sql[4096];
-    snprintf(sql, sizeof(sql),
-            "INSERT INTO hidelist (package_name, process) VALUES('%s', '%s')", pkg, proc);
-    char *err = db_exec(sql);
+    char *err = db_query("INSERT INTO hidelist (package_name, process) VALUES(?, ?)",
+                         { pkg, proc });
     db_err_cmd(err, return DAEMON_ERROR);
 
     {
@@ -200,13 +198,11 @@ static int rm_list(const char *pkg, const char *proc) {
     if (!remove)
         return HIDE_ITEM_NOT_EXIST;
 
-    char sql[4096];
+    char *err;
     if (proc[0] == '\0')
-        snprintf(sql, sizeof(sql), "DELETE FROM hidelist WHERE package_name='%s'", pkg);
+        err = db_query("DELETE FROM hidelist WHERE package_name=?", { pkg });
     else
-        snprintf(sql, sizeof(sql),
-                "DELETE FROM hidelist WHERE package_name='%s' AND process='%s'", pkg, proc);
-    char *err = db_exec(sql);
+        err = db_query("DELETE FROM hidelist WHERE package_name=? AND process=?", { pkg, proc });
     db_err(err);
     return DAEMON_SUCCESS;
 }
@@ -270,10 +266,8 @@ void ls_list(int client) {
 }
 
 static void update_hide_config() {
-    char sql[64];
-    sprintf(sql, "REPLACE INTO settings (key,value) VALUES('%s',%d)",
-            DB_SETTING_KEYS[HIDE_CONFIG], hide_state);
-    char *err = db_exec(sql);
+    char *err = db_query("REPLACE INTO settings (key,value) VALUES(?,?)",
+                         { DB_SETTING_KEYS[HIDE_CONFIG], (int) hide_state });
     db_err(err);
 }
 
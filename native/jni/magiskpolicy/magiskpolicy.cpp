@@ -23,6 +23,9 @@ Options:
                      Magisk selinux environment
    --apply FILE      apply rules from FILE, read and parsed
                      line by line as policy statements
+   --compile-rules IN OUT
+                     compile rules from IN into a binary blob
+                     OUT that can be loaded without parsing
 
 If neither --load or --compile-split is specified, it will load
 from current live policies (/sys/fs/selinux/policy)
@@ -80,6 +83,15 @@ int magiskpolicy_main(int argc, char *argv[]) {
                     usage(argv[0]);
                 rule_file = argv[i + 1];
                 ++i;
+            } else if (option == "compile-rules"sv) {
+                if (argv[i + 1] == nullptr || argv[i + 2] == nullptr)
+                    usage(argv[0]);
+                // No policy is needed, rules are only checked for syntax
+                if (!sepolicy::compile_rules(argv[i + 1], argv[i + 2])) {
+                    fprintf(stderr, "Cannot compile rules to %s\n", argv[i + 2]);
+                    return 1;
+                }
+                return 0;
             } else if (option == "help"sv) {
                 statement_help();
             } else {
@@ -99,11 +111,13 @@ int magiskpolicy_main(int argc, char *argv[]) {
     if (magisk)
         sepol->magisk_rules();
 
+    sepol->begin();
     if (rule_file)
         sepol->load_rule_file(rule_file);
 
     for (; i < argc; ++i)
         sepol->parse_statement(argv[i]);
+    sepol->commit();
 
     if (live && !sepol->to_file(SELINUX_LOAD)) {
         fprintf(stderr, "Cannot apply policy\n");
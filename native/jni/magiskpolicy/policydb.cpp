@@ -4,13 +4,17 @@
 #include <unistd.h>
 
 #include <cil/cil.h>
+#include <mincrypt/sha256.h>
 
 #include <utils.hpp>
 #include <stream.hpp>
 #include <magiskpolicy.hpp>
+#include <flags.hpp>
 
 #include "sepolicy.hpp"
 
+using namespace std;
+
 #define SHALEN 64
 static bool cmp_sha256(const char *a, const char *b) {
     char id_a[SHALEN] = {0};
@@ -103,77 +107,79 @@ sepolicy *sepolicy::from_file(const char *file) {
     return sepol;
 }
 
-sepolicy *sepolicy::compile_split() {
+// All CIL files of the split policy, in loading order
+static bool split_cil_files(vector<string> &files, int &policy_ver) {
     char path[128], plat_ver[10];
-    cil_db_t *db = nullptr;
-    sepol_policydb_t *pdb = nullptr;
     FILE *f;
-    int policy_ver;
-    const char *cil_file;
-
-    cil_db_init(&db);
-    run_finally fin([db_ptr = &db]{ cil_db_destroy(db_ptr); });
-    cil_set_mls(db, 1);
-    cil_set_multiple_decls(db, 1);
-    cil_set_disable_neverallow(db, 1);
-    cil_set_target_platform(db, SEPOL_TARGET_SELINUX);
-    cil_set_attrs_expand_generated(db, 0);
 
     f = xfopen(SELINUX_VERSION, "re");
+    if (f == nullptr)
+        return false;
     fscanf(f, "%d", &policy_ver);
     fclose(f);
-    cil_set_policy_version(db, policy_ver);
 
     // Get mapping version
     f = xfopen(VEND_POLICY_DIR "plat_sepolicy_vers.txt", "re");
-    fscanf(f, "%s", plat_ver);
+    if (f == nullptr)
+        return false;
+    fscanf(f, "%9s", plat_ver);
     fclose(f);
 
+    auto add_opt = [&](const char *file) {
+        if (access(file, R_OK) == 0)
+            files.emplace_back(file);
+    };
+
     // plat
-    load_cil(db, SPLIT_PLAT_CIL);
+    files.emplace_back(SPLIT_PLAT_CIL);
 
     sprintf(path, PLAT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    load_cil(db, path);
+    files.emplace_back(path);
 
     sprintf(path, PLAT_POLICY_DIR "mapping/%s.compat.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
+    add_opt(path);
 
     // system_ext
     sprintf(path, SYSEXT_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    cil_file = SYSEXT_POLICY_DIR "system_ext_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add_opt(path);
+    add_opt(SYSEXT_POLICY_DIR "system_ext_sepolicy.cil");
 
     // product
     sprintf(path, PROD_POLICY_DIR "mapping/%s.cil", plat_ver);
-    if (access(path, R_OK) == 0)
-        load_cil(db, path);
-
-    cil_file = PROD_POLICY_DIR "product_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add_opt(path);
+    add_opt(PROD_POLICY_DIR "product_sepolicy.cil");
 
     // vendor
-    cil_file = VEND_POLICY_DIR "nonplat_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    add_opt(VEND_POLICY_DIR "nonplat_sepolicy.cil");
+    add_opt(VEND_POLICY_DIR "plat_pub_versioned.cil");
+    add_opt(VEND_POLICY_DIR "vendor_sepolicy.cil");
 
-    cil_file = VEND_POLICY_DIR "plat_pub_versioned.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    // odm
+    add_opt(ODM_POLICY_DIR "odm_sepolicy.cil");
+
+    return true;
+}
 
-    cil_file = VEND_POLICY_DIR "vendor_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+sepolicy *sepolicy::compile_split() {
+    cil_db_t *db = nullptr;
+    sepol_policydb_t *pdb = nullptr;
+    int policy_ver;
+    vector<string> files;
 
-    // odm
-    cil_file = ODM_POLICY_DIR "odm_sepolicy.cil";
-    if (access(cil_file, R_OK) == 0)
-        load_cil(db, cil_file);
+    if (!split_cil_files(files, policy_ver))
+        return nullptr;
+
+    cil_db_init(&db);
+    run_finally fin([db_ptr = &db]{ cil_db_destroy(db_ptr); });
+    cil_set_mls(db, 1);
+    cil_set_multiple_decls(db, 1);
+    cil_set_disable_neverallow(db, 1);
+    cil_set_target_platform(db, SEPOL_TARGET_SELINUX);
+    cil_set_attrs_expand_generated(db, 0);
+    cil_set_policy_version(db, policy_ver);
+
+    for (auto &file : files)
+        load_cil(db, file.data());
 
     if (cil_compile(db))
         return nullptr;
@@ -185,17 +191,67 @@ sepolicy *sepolicy::compile_split() {
     return sepol;
 }
 
-sepolicy *sepolicy::from_split() {
+static const char *find_precompiled() {
     const char *odm_pre = ODM_POLICY_DIR "precompiled_sepolicy";
     const char *vend_pre = VEND_POLICY_DIR "precompiled_sepolicy";
     if (access(odm_pre, R_OK) == 0 && check_precompiled(odm_pre))
-        return sepolicy::from_file(odm_pre);
+        return odm_pre;
     else if (access(vend_pre, R_OK) == 0 && check_precompiled(vend_pre))
-        return sepolicy::from_file(vend_pre);
+        return vend_pre;
+    return nullptr;
+}
+
+sepolicy *sepolicy::from_split() {
+    if (auto precompiled = find_precompiled())
+        return sepolicy::from_file(precompiled);
     else
         return sepolicy::compile_split();
 }
 
+static void hash_file(SHA256_CTX *ctx, const char *file) {
+    char *addr;
+    size_t size;
+    mmap_ro(file, addr, size);
+    // Separate files so contents cannot shift between them
+    SHA256_update(ctx, file, strlen(file) + 1);
+    SHA256_update(ctx, &size, sizeof(size));
+    if (addr) {
+        SHA256_update(ctx, addr, size);
+        munmap(addr, size);
+    }
+}
+
+string sepolicy::split_digest(const vector<string> &rule_files) {
+    if (find_precompiled())
+        return {};
+
+    int policy_ver;
+    vector<string> files;
+    if (!split_cil_files(files, policy_ver))
+        return {};
+
+    SHA256_CTX ctx;
+    SHA256_init(&ctx);
+    // The built-in Magisk rules only change with the binary
+    SHA256_update(&ctx, MAGISK_VERSION, sizeof(MAGISK_VERSION));
+    int ver = MAGISK_VER_CODE;
+    SHA256_update(&ctx, &ver, sizeof(ver));
+    SHA256_update(&ctx, &policy_ver, sizeof(policy_ver));
+    for (auto &file : files)
+        hash_file(&ctx, file.data());
+    for (auto &file : rule_files)
+        hash_file(&ctx, file.data());
+
+    const uint8_t *digest = SHA256_final(&ctx);
+    string hex;
+    char byte[3];
+    for (int i = 0; i < SHA256_DIGEST_SIZE; ++i) {
+        sprintf(byte, "%02x", digest[i]);
+        hex += byte;
+    }
+    return hex;
+}
+
 sepolicy::~sepolicy() {
     policydb_destroy(db);
     free(db);
@@ -205,6 +261,12 @@ bool sepolicy::to_file(const char *file) {
     uint8_t *data;
     size_t len;
 
+    // Never write out a policy with stale indexes
+    if (!impl->index_types()) {
+        LOGE("Fail to index policy types\n");
+        return false;
+    }
+
     /* No partial writes are allowed to /sys/fs/selinux/load, thus the reason why we
      * first dump everything into memory, then directly call write system call */
 
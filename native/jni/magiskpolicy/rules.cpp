@@ -9,6 +9,7 @@ void sepolicy::magisk_rules() {
     // Temp suppress warnings
     auto bak = log_cb.w;
     log_cb.w = nop_log;
+    begin();
 
     // This indicates API 26+
     bool new_rules = exists("untrusted_app_25");
@@ -193,5 +194,6 @@ void sepolicy::magisk_rules() {
     impl->strip_dontaudit();
 #endif
 
+    commit();
     log_cb.w = bak;
 }
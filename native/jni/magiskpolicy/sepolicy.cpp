@@ -1,3 +1,5 @@
+#include <vector>
+
 #include <sepol/policydb/policydb.h>
 
 #include <magiskpolicy.hpp>
@@ -5,6 +7,8 @@
 
 #include "sepolicy.hpp"
 
+using namespace std;
+
 #if 0
 // Print out all rules going through public API for debugging
 template <typename ...Args>
@@ -153,53 +157,82 @@ avtab_ptr_t sepol_impl::get_avtab_node(avtab_key_t *key, avtab_extended_perms_t
     return node;
 }
 
+static void update_av(avtab_ptr_t node, perm_datum_t *perm, bool invert) {
+    if (invert) {
+        if (perm)
+            node->datum.data &= ~(1U << (perm->s.value - 1));
+        else
+            node->datum.data = 0U;
+    } else {
+        if (perm)
+            node->datum.data |= 1U << (perm->s.value - 1);
+        else
+            node->datum.data = ~0U;
+    }
+}
+
 void sepol_impl::add_rule(type_datum_t *src, type_datum_t *tgt, class_datum_t *cls, perm_datum_t *perm, int effect, bool invert) {
-    if (src == nullptr) {
-        if (strip_av(effect, invert)) {
-            // Stripping av, have to go through all types for correct results
-            hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
-                add_rule(auto_cast(node->datum), tgt, cls, perm, effect, invert);
-            });
-        } else {
-            // If we are not stripping av, go through all attributes instead of types for optimization
-            for_each_attr(db->p_types.table, [&](type_datum_t *type) {
-                add_rule(type, tgt, cls, perm, effect, invert);
-            });
-        }
-    } else if (tgt == nullptr) {
-        if (strip_av(effect, invert)) {
-            hashtab_for_each(db->p_types.table, [&](hashtab_ptr_t node) {
-                add_rule(src, auto_cast(node->datum), cls, perm, effect, invert);
-            });
-        } else {
-            for_each_attr(db->p_types.table, [&](type_datum_t *type) {
-                add_rule(src, type, cls, perm, effect, invert);
-            });
+    bool strip = strip_av(effect, invert);
+
+    if (strip && (src == nullptr || tgt == nullptr)) {
+        // Stripping av never adds access, so nodes that do not exist are not affected.
+        // Instead of visiting every type, go through the existing nodes once.
+        vector<avtab_ptr_t> nodes;
+        avtab_for_each(&db->te_avtab, [&](avtab_ptr_t node) {
+            if (node->key.specified == effect &&
+                (src == nullptr || node->key.source_type == src->s.value) &&
+                (tgt == nullptr || node->key.target_type == tgt->s.value) &&
+                (cls == nullptr || node->key.target_class == cls->s.value))
+                nodes.push_back(node);
+        });
+        for (auto node : nodes) {
+            update_av(node, perm, invert);
+            check_avtab_node(node);
         }
-    } else if (cls == nullptr) {
-        hashtab_for_each(db->p_classes.table, [&](hashtab_ptr_t node) {
-            add_rule(src, tgt, auto_cast(node->datum), perm, effect, invert);
+        return;
+    }
+
+    // Expand all wildcards up front, then update the avtab in a single batch.
+    // If we are not stripping av, go through all attributes instead of types for optimization.
+    vector<uint16_t> attrs, srcs, tgts, clss;
+    if (src == nullptr || tgt == nullptr) {
+        for_each_attr(db->p_types.table, [&](type_datum_t *type) {
+            attrs.push_back(type->s.value);
         });
+    }
+    if (src)
+        srcs.push_back(src->s.value);
+    if (tgt)
+        tgts.push_back(tgt->s.value);
+    if (cls) {
+        clss.push_back(cls->s.value);
     } else {
-        avtab_key_t key;
-        key.source_type = src->s.value;
-        key.target_type = tgt->s.value;
-        key.target_class = cls->s.value;
-        key.specified = effect;
+        hashtab_for_each(db->p_classes.table, [&](hashtab_ptr_t node) {
+            clss.push_back(static_cast<class_datum_t *>(node->datum)->s.value);
+        });
+    }
 
-        avtab_ptr_t node = get_avtab_node(&key, nullptr);
-        if (invert) {
-            if (perm)
-                node->datum.data &= ~(1U << (perm->s.value - 1));
-            else
-                node->datum.data = 0U;
-        } else {
-            if (perm)
-                node->datum.data |= 1U << (perm->s.value - 1);
-            else
-                node->datum.data = ~0U;
+    avtab_key_t key;
+    key.specified = effect;
+    for (auto s : src ? srcs : attrs) {
+        key.source_type = s;
+        for (auto t : tgt ? tgts : attrs) {
+            key.target_type = t;
+            for (auto c : clss) {
+                key.target_class = c;
+                avtab_ptr_t node;
+                if (strip) {
+                    // Do not create nodes just to strip them
+                    node = avtab_search_node(&db->te_avtab, &key);
+                    if (node == nullptr)
+                        continue;
+                } else {
+                    node = get_avtab_node(&key, nullptr);
+                }
+                update_av(node, perm, invert);
+                check_avtab_node(node);
+            }
         }
-        check_avtab_node(node);
     }
 }
 
@@ -538,18 +571,29 @@ bool sepol_impl::add_type(const char *type_name, uint32_t flavor) {
     ebitmap_init(&db->attr_type_map[value - 1]);
     ebitmap_set_bit(&db->type_attr_map[value - 1], value - 1, 1);
 
+    // Add the type to all roles
+    for (int i = 0; i < db->p_roles.nprim; ++i) {
+        ebitmap_set_bit(&db->role_val_to_struct[i]->types.negset, value - 1, 0);
+        ebitmap_set_bit(&db->role_val_to_struct[i]->types.types, value - 1, 1);
+    }
+
+    types_dirty = true;
+    return txn_depth > 0 || index_types();
+}
+
+bool sepol_impl::index_types() {
+    if (!types_dirty)
+        return true;
+    types_dirty = false;
+
     // Re-index stuffs
     if (policydb_index_decls(nullptr, db) ||
         policydb_index_classes(db) || policydb_index_others(nullptr, db, 0))
         return false;
 
-    // Add the type to all roles
-    for (int i = 0; i < db->p_roles.nprim; ++i) {
-        // Not sure all those three calls are needed
-        ebitmap_set_bit(&db->role_val_to_struct[i]->types.negset, value - 1, 0);
-        ebitmap_set_bit(&db->role_val_to_struct[i]->types.types, value - 1, 1);
+    // Expand all new types into the roles' cache in a single pass
+    for (int i = 0; i < db->p_roles.nprim; ++i)
         type_set_expand(&db->role_val_to_struct[i]->types, &db->role_val_to_struct[i]->cache, db, 0);
-    }
 
     return true;
 }
@@ -617,10 +661,24 @@ bool sepol_impl::add_typeattribute(const char *type, const char *attr) {
 }
 
 void sepol_impl::strip_dontaudit() {
-    avtab_for_each(&db->te_avtab, [=](avtab_ptr_t node) {
+    // Nodes cannot be freed while walking the table
+    vector<avtab_ptr_t> nodes;
+    avtab_for_each(&db->te_avtab, [&](avtab_ptr_t node) {
         if (node->key.specified == AVTAB_AUDITDENY || node->key.specified == AVTAB_XPERMS_DONTAUDIT)
-            avtab_remove_node(&db->te_avtab, node);
+            nodes.push_back(node);
     });
+    for (auto node : nodes)
+        avtab_remove_node(&db->te_avtab, node);
+}
+
+void sepolicy::begin() {
+    ++txn_depth;
+}
+
+bool sepolicy::commit() {
+    if (txn_depth > 0 && --txn_depth > 0)
+        return true;
+    return impl->index_types();
 }
 
 bool sepolicy::allow(const char *s, const char *t, const char *c, const char *p) {
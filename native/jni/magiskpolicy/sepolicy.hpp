@@ -16,6 +16,7 @@ struct sepol_impl : public sepolicy {
     bool add_filename_trans(const char *s, const char *t, const char *c, const char *d, const char *o);
     bool add_genfscon(const char *fs_name, const char *path, const char *context);
     bool add_type(const char *type_name, uint32_t flavor);
+    bool index_types();
     bool set_type_state(const char *type_name, bool permissive);
     void add_typeattribute(type_datum_t *type, type_datum_t *attr);
     bool add_typeattribute(const char *type, const char *attr);
@@ -1,6 +1,14 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <climits>
 #include <cstring>
 #include <vector>
 #include <string>
+#include <unordered_map>
+
+#include <mincrypt/sha256.h>
 
 #include <magiskpolicy.hpp>
 #include <utils.hpp>
@@ -137,11 +145,6 @@ static bool check_tokens(parsed_tokens &arr) {
     return true;
 }
 
-template <int size, int ...ones>
-static bool tokenize_and_check(char *stmt, parsed_tokens &arr) {
-    return tokenize_string(stmt, arr) && check_tokens<size, ones...>(arr);
-}
-
 template <typename Func, typename ...Args>
 static void run_and_check(const Func &fn, const char *action, Args ...args) {
     if (!fn(args...)) {
@@ -156,9 +159,8 @@ static void run_and_check(const Func &fn, const char *action, Args ...args) {
 
 // Pattern 1: allow { source } { target } { class } { permission }
 template <typename Func>
-static bool parse_pattern_1(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<4>(stmt, arr))
+static bool parse_pattern_1(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<4>(arr))
         return false;
     for (auto src : arr[0])
         for (auto tgt : arr[1])
@@ -170,9 +172,8 @@ static bool parse_pattern_1(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 2: allowxperm { source } { target } { class } ioctl range
 template <typename Func>
-static bool parse_pattern_2(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<5, 3, 4>(stmt, arr) || arr[3][0] != "ioctl"sv)
+static bool parse_pattern_2(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<5, 3, 4>(arr) || arr[3][0] != "ioctl"sv)
         return false;
     auto range = arr[4][0];
     for (auto src : arr[0])
@@ -184,9 +185,8 @@ static bool parse_pattern_2(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 3: permissive { type }
 template <typename Func>
-static bool parse_pattern_3(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<1>(stmt, arr))
+static bool parse_pattern_3(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<1>(arr))
         return false;
     for (auto type : arr[0])
         run_fn(type);
@@ -195,9 +195,8 @@ static bool parse_pattern_3(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 4: typeattribute { type } { attribute }
 template <typename Func>
-static bool parse_pattern_4(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<2>(stmt, arr))
+static bool parse_pattern_4(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<2>(arr))
         return false;
     for (auto type : arr[0])
         for (auto attr : arr[1])
@@ -207,11 +206,7 @@ static bool parse_pattern_4(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 5: type name { attribute }
 template <typename Func>
-static bool parse_pattern_5(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    string tmp_str;
-    if (!tokenize_string(stmt, arr))
-        return false;
+static bool parse_pattern_5(const Func &fn, const char *action, parsed_tokens &arr) {
     if (arr.size() == 1) {
         arr.emplace_back(initializer_list<const char*>{ "domain" });
     }
@@ -224,20 +219,16 @@ static bool parse_pattern_5(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 6: attribute name
 template <typename Func>
-static bool parse_pattern_6(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<1, 0>(stmt, arr))
+static bool parse_pattern_6(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<1, 0>(arr))
         return false;
-    run_fn(arr[0][1]);
+    run_fn(arr[0][0]);
     return true;
 }
 
 // Pattern 7: type_transition source target class default (filename)
 template <typename Func>
-static bool parse_pattern_7(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_string(stmt, arr))
-        return false;
+static bool parse_pattern_7(const Func &fn, const char *action, parsed_tokens &arr) {
     if (arr.size() == 4)
         arr.emplace_back(initializer_list<const char*>{nullptr});
     if (!check_tokens<5, 0, 1, 2, 3, 4>(arr))
@@ -248,9 +239,8 @@ static bool parse_pattern_7(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 8: type_change source target class default
 template <typename Func>
-static bool parse_pattern_8(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<4, 0, 1, 2, 3>(stmt, arr))
+static bool parse_pattern_8(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<4, 0, 1, 2, 3>(arr))
         return false;
     run_fn(arr[0][0], arr[1][0], arr[2][0], arr[3][0]);
     return true;
@@ -258,34 +248,26 @@ static bool parse_pattern_8(const Func &fn, const char *action, char *stmt) {
 
 // Pattern 9: genfscon name path context
 template <typename Func>
-static bool parse_pattern_9(const Func &fn, const char *action, char *stmt) {
-    parsed_tokens arr;
-    if (!tokenize_and_check<3, 0, 1, 2>(stmt, arr))
+static bool parse_pattern_9(const Func &fn, const char *action, parsed_tokens &arr) {
+    if (!check_tokens<3, 0, 1, 2>(arr))
         return false;
     run_fn(arr[0][0], arr[1][0], arr[2][0]);
     return true;
 }
 
+// Without a policy, statements are only checked for syntax errors
 #define add_action_func(name, type, fn) \
 else if (strcmp(name, action) == 0) { \
-    auto __fn = [=](auto && ...args){ return (fn)(args...); };\
-    if (!parse_pattern_##type(__fn, name, remain)) \
-        LOGW("Syntax error in '%s'\n\n%s\n", stmt, type_msg_##type); \
+    auto __fn = [=](auto && ...args){ return sepol ? sepol->fn(args...) : true; };\
+    *msg = type_msg_##type; \
+    return tokenized && parse_pattern_##type(__fn, name, arr); \
 }
 
 #define add_action(act, type) add_action_func(#act, type, act)
 
-void sepolicy::parse_statement(const char *stmt) {
-    // strtok modify strings, create a copy
-    string cpy(stmt);
-
-    char *remain;
-    char *action = strtok_r(cpy.data(), " ", &remain);
-    if (remain == nullptr) {
-        LOGW("Syntax error in '%s'\n\n", stmt);
-        return;
-    }
-
+// On failure, msg is set to the usage of the action, or nullptr if the action is unknown
+static bool run_statement(sepolicy *sepol, const char *action,
+        parsed_tokens &arr, bool tokenized, const char **msg) {
     if (0) {}
     add_action(allow, 1)
     add_action(deny, 1)
@@ -309,14 +291,250 @@ void sepolicy::parse_statement(const char *stmt) {
     add_action_func("attradd", 4, typeattribute)
     add_action_func("name_transition", 7, type_transition)
 
-    else { LOGW("Unknown action: '%s'\n\n", action); }
+    *msg = nullptr;
+    return false;
+}
+
+// Tokenize a statement into its action and arguments, returns false on syntax errors
+static bool parse_line(sepolicy *sepol, const char *stmt, string &cpy,
+        const char *&action, parsed_tokens &arr) {
+    // strtok modify strings, create a copy
+    cpy = stmt;
+
+    char *remain;
+    action = strtok_r(cpy.data(), " ", &remain);
+    if (remain == nullptr) {
+        LOGW("Syntax error in '%s'\n\n", stmt);
+        return false;
+    }
+
+    bool tokenized = tokenize_string(remain, arr);
+    // The patterns fill in default arguments, only validate a copy
+    parsed_tokens tmp;
+    parsed_tokens &args = sepol ? arr : (tmp = arr);
+    const char *msg;
+    if (!run_statement(sepol, action, args, tokenized, &msg)) {
+        if (msg)
+            LOGW("Syntax error in '%s'\n\n%s\n", stmt, msg);
+        else
+            LOGW("Unknown action: '%s'\n\n", action);
+        return false;
+    }
+    return true;
+}
+
+void sepolicy::parse_statement(const char *stmt) {
+    string cpy;
+    const char *action;
+    parsed_tokens arr;
+    parse_line(this, stmt, cpy, action, arr);
 }
 
 void sepolicy::load_rule_file(const char *file) {
+    begin();
     file_readline(true, file, [=](string_view line) -> bool {
         if (line.empty() || line[0] == '#')
             return true;
         parse_statement(line.data());
         return true;
     });
+    commit();
+}
+
+/*
+ * Compiled rule blob layout:
+ *
+ * rule_blob_hdr
+ * uint32_t sym_offs[sym_num]   offsets of symbol names in the string pool
+ * uint32_t words[word_num]     statements
+ * char strs[str_size]          string pool of null terminated symbol names
+ *
+ * Each statement is encoded as [action][argc], followed by [count][symbols...]
+ * for each argument. Symbols are indices into sym_offs, BLOB_WILDCARD is '*'.
+ * The size and SHA-256 of the source rule file tie the blob to it.
+ */
+
+#define BLOB_MAGIC    "MPRB"
+#define BLOB_VERSION  2
+#define BLOB_WILDCARD UINT32_MAX
+
+struct rule_blob_hdr {
+    char magic[4];
+    uint32_t version;
+    uint32_t sym_num;
+    uint32_t word_num;
+    uint32_t str_size;
+    uint32_t src_size;
+    uint8_t src_sha256[SHA256_DIGEST_SIZE];
+};
+
+static bool hash_source(const char *file, uint32_t &size, uint8_t *digest) {
+    if (access(file, R_OK) != 0)
+        return false;
+    char *buf;
+    size_t sz;
+    // Empty files are not mapped
+    mmap_ro(file, buf, sz);
+    run_finally fin([=]{ if (buf) munmap(buf, sz); });
+    if (sz > INT_MAX)
+        return false;
+    SHA256_hash(buf ? buf : "", sz, digest);
+    size = sz;
+    return true;
+}
+
+bool sepolicy::compile_rules(const char *in, const char *out) {
+    rule_blob_hdr hdr{};
+    if (!hash_source(in, hdr.src_size, hdr.src_sha256)) {
+        PLOGE("Read %s", in);
+        return false;
+    }
+
+    unordered_map<string, uint32_t> syms;
+    vector<uint32_t> offs;
+    vector<uint32_t> words;
+    string strs;
+
+    auto intern = [&](const char *name) -> uint32_t {
+        if (name == nullptr)
+            return BLOB_WILDCARD;
+        auto [it, added] = syms.try_emplace(name, offs.size());
+        if (added) {
+            offs.push_back(strs.size());
+            strs.append(name, strlen(name) + 1);
+        }
+        return it->second;
+    };
+
+    file_readline(true, in, [&](string_view line) -> bool {
+        if (line.empty() || line[0] == '#')
+            return true;
+        string cpy;
+        const char *action;
+        parsed_tokens arr;
+        // Invalid statements are reported and dropped, just like when loading text rules
+        if (!parse_line(nullptr, line.data(), cpy, action, arr))
+            return true;
+        words.push_back(intern(action));
+        words.push_back(arr.size());
+        for (auto &arg : arr) {
+            words.push_back(arg.size());
+            for (auto name : arg)
+                words.push_back(intern(name));
+        }
+        return true;
+    });
+
+    memcpy(hdr.magic, BLOB_MAGIC, sizeof(hdr.magic));
+    hdr.version = BLOB_VERSION;
+    hdr.sym_num = offs.size();
+    hdr.word_num = words.size();
+    hdr.str_size = strs.size();
+
+    int fd = xopen(out, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = xwrite(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+              xwrite(fd, offs.data(), offs.size() * 4) == offs.size() * 4 &&
+              xwrite(fd, words.data(), words.size() * 4) == words.size() * 4 &&
+              xwrite(fd, strs.data(), strs.size()) == strs.size();
+    close(fd);
+    if (!ok)
+        unlink(out);
+    return ok;
+}
+
+bool sepolicy::load_rule_blob(const char *file, const char *src) {
+    char *buf;
+    size_t sz;
+    mmap_ro(file, buf, sz);
+    if (buf == nullptr)
+        return false;
+    run_finally fin([=]{ munmap(buf, sz); });
+
+    auto hdr = reinterpret_cast<const rule_blob_hdr *>(buf);
+    if (sz < sizeof(*hdr) || memcmp(hdr->magic, BLOB_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->version != BLOB_VERSION ||
+        sizeof(*hdr) + (hdr->sym_num + (uint64_t) hdr->word_num) * 4 + hdr->str_size != sz) {
+        LOGW("Invalid rule blob %s\n", file);
+        return false;
+    }
+    uint32_t src_size;
+    uint8_t src_sha256[SHA256_DIGEST_SIZE];
+    if (!hash_source(src, src_size, src_sha256) || src_size != hdr->src_size ||
+        memcmp(src_sha256, hdr->src_sha256, sizeof(src_sha256)) != 0) {
+        LOGW("Rule blob %s does not match %s\n", file, src);
+        return false;
+    }
+    auto offs = reinterpret_cast<const uint32_t *>(hdr + 1);
+    auto words = offs + hdr->sym_num;
+    auto strs = reinterpret_cast<const char *>(words + hdr->word_num);
+    if (hdr->str_size && strs[hdr->str_size - 1] != '\0') {
+        LOGW("Invalid rule blob %s\n", file);
+        return false;
+    }
+
+    // Resolve all symbols and decode every statement before applying anything
+    vector<const char *> names(hdr->sym_num);
+    for (uint32_t i = 0; i < hdr->sym_num; ++i) {
+        if (offs[i] >= hdr->str_size) {
+            LOGW("Invalid rule blob %s\n", file);
+            return false;
+        }
+        names[i] = strs + offs[i];
+    }
+
+    vector<pair<const char *, parsed_tokens>> stmts;
+    bool valid = true;
+    uint32_t pos = 0;
+    auto next = [&](uint32_t &word) -> bool {
+        if (pos >= hdr->word_num)
+            return valid = false;
+        word = words[pos++];
+        return true;
+    };
+    auto symbol = [&](const char *&name) -> bool {
+        uint32_t id;
+        if (!next(id))
+            return false;
+        if (id == BLOB_WILDCARD)
+            name = nullptr;
+        else if (id < hdr->sym_num)
+            name = names[id];
+        else
+            return valid = false;
+        return true;
+    };
+    while (valid && pos < hdr->word_num) {
+        uint32_t action, argc;
+        if (!next(action) || action >= hdr->sym_num || !next(argc) || argc > hdr->word_num) {
+            valid = false;
+            break;
+        }
+        auto &[act, arr] = stmts.emplace_back(names[action], parsed_tokens(argc));
+        for (auto &arg : arr) {
+            uint32_t count;
+            if (!next(count) || count > hdr->word_num) {
+                valid = false;
+                break;
+            }
+            arg.resize(count);
+            for (auto &name : arg)
+                if (!symbol(name))
+                    break;
+        }
+    }
+    if (!valid) {
+        LOGW("Invalid rule blob %s\n", file);
+        return false;
+    }
+
+    begin();
+    for (auto &[action, arr] : stmts) {
+        const char *msg;
+        if (!run_statement(this, action, arr, true, &msg))
+            LOGW("Invalid statement '%s' in %s\n", action, file);
+    }
+    commit();
+    return true;
 }
@@ -287,6 +287,12 @@ int delprop(const char *name, bool persist) {
     return get_impl()->delprop(name, persist);
 }
 
+void setprops(const vector<pair<string, string>> &props, bool prop_svc) {
+    auto impl = get_impl();
+    for (auto &[key, val] : props)
+        impl->setprop(key.data(), val.data(), prop_svc);
+}
+
 void load_prop_file(const char *filename, bool prop_svc) {
     auto impl = get_impl();
     LOGD("resetprop: Parse prop file [%s]\n", filename);
@@ -1,5 +1,8 @@
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <poll.h>
 
 #include <utils.hpp>
 #include <selinux.hpp>
@@ -98,6 +101,26 @@ static bool check_no_error(int fd) {
     return true;
 }
 
+static bool call_provider(const char *action, vector<Extra> &data, const shared_ptr<su_info> &info) {
+    char target[128];
+    char user[4];
+    sprintf(user, "%d", get_user(info));
+    sprintf(target, "content://%s.provider", info->str[SU_MANAGER].data());
+    vector<const char *> args{ CALL_PROVIDER };
+    for (auto &e : data) {
+        e.add_bind(args);
+    }
+    args.push_back(nullptr);
+    exec_t exec {
+        .err = true,
+        .fd = -1,
+        .pre_exec = [] { setenv("CLASSPATH", "/system/framework/content.jar", 1); },
+        .argv = args.data()
+    };
+    exec_command_sync(exec);
+    return check_no_error(exec.fd);
+}
+
 static void exec_cmd(const char *action, vector<Extra> &data,
                      const shared_ptr<su_info> &info, int mode = CONTENT_PROVIDER) {
     char target[128];
@@ -105,23 +128,8 @@ static void exec_cmd(const char *action, vector<Extra> &data,
     sprintf(user, "%d", get_user(info));
 
     // First try content provider call method
-    if (mode >= CONTENT_PROVIDER) {
-        sprintf(target, "content://%s.provider", info->str[SU_MANAGER].data());
-        vector<const char *> args{ CALL_PROVIDER };
-        for (auto &e : data) {
-            e.add_bind(args);
-        }
-        args.push_back(nullptr);
-        exec_t exec {
-            .err = true,
-            .fd = -1,
-            .pre_exec = [] { setenv("CLASSPATH", "/system/framework/content.jar", 1); },
-            .argv = args.data()
-        };
-        exec_command_sync(exec);
-        if (check_no_error(exec.fd))
-            return;
-    }
+    if (mode >= CONTENT_PROVIDER && call_provider(action, data, info))
+        return;
 
     vector<const char *> args{ START_ACTIVITY };
     for (auto &e : data) {
@@ -151,32 +159,237 @@ static void exec_cmd(const char *action, vector<Extra> &data,
     exec_command(exec);
 }
 
-void app_log(const su_context &ctx) {
+/********************
+ * Notifier Channel
+ ********************/
+
+/* Log and notify events are queued and streamed to the manager through a
+ * FIFO that the manager keeps reading, so an event costs a write instead of
+ * an app_process launch. The manager is only called through the content
+ * provider to open a new channel. Managers not supporting the channel, or
+ * events for another manager instance, fall back to the provider call. */
+
+#define CHANNEL_IDLE_TIME   30    /* Close an idle channel after 30 seconds */
+#define CHANNEL_RETRY_TIME  300   /* Do not retry a failed channel for 5 minutes */
+#define CHANNEL_WRITE_TIME  500   /* Give up on a stalled manager after 500ms */
+#define MAX_QUEUED_EVENTS   256
+
+struct su_event {
+    const char *action;
+    shared_ptr<su_info> info;
+    vector<pair<const char *, string>> extras;
+
+    // Values are typed by key, as expected by the manager
+    vector<Extra> to_extras() {
+        vector<Extra> ret;
+        ret.reserve(extras.size());
+        for (auto &[key, val] : extras) {
+            if (key == "command"sv)
+                ret.emplace_back(key, val.data());
+            else if (key == "notify"sv)
+                ret.emplace_back(key, val == "1");
+            else
+                ret.emplace_back(key, parse_int(val));
+        }
+        return ret;
+    }
+};
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+static vector<su_event> events;
+static bool notifier_running = false;
+
+// Only accessed by the notifier thread
+static int channel_fd = -1;
+static string channel_target;
+static time_t channel_retry = 0;
+
+static void write_entry(string &buf, string_view key, string_view val) {
+    for (auto str : { key, val }) {
+        uint32_t len = htonl(str.size());
+        buf.append(reinterpret_cast<char *>(&len), sizeof(len));
+        buf.append(str);
+    }
+}
+
+static bool open_channel(const shared_ptr<su_info> &info, const string &target) {
+    if (time(nullptr) < channel_retry)
+        return false;
+
+    char fifo[64];
+    strcpy(fifo, "/dev/socket/");
+    gen_rand_str(fifo + 12, 32, true);
+    mkfifo(fifo, 0600);
+    chown(fifo, info->mgr_st.st_uid, info->mgr_st.st_gid);
+    setfilecon(fifo, "u:object_r:" SEPOL_FILE_TYPE ":s0");
+
+    vector<Extra> extras;
+    extras.emplace_back("fifo", fifo);
+    call_provider("channel", extras, info);
+
+    // Wait for at most 5 seconds for the manager to open the reading end
+    int fd = -1;
+    for (int i = 0; i < 50; ++i) {
+        if ((fd = open(fifo, O_WRONLY | O_NONBLOCK | O_CLOEXEC)) >= 0)
+            break;
+        usleep(100000);
+    }
+    unlink(fifo);
+    if (fd < 0) {
+        LOGW("su: manager channel unavailable\n");
+        channel_retry = time(nullptr) + CHANNEL_RETRY_TIME;
+        return false;
+    }
+    // Stay non-blocking, a frozen manager must not stall the notifier
+    channel_fd = fd;
+    channel_target = target;
+    return true;
+}
+
+static void close_channel() {
+    if (channel_fd >= 0)
+        close(channel_fd);
+    channel_fd = -1;
+    channel_target.clear();
+}
+
+static void legacy_deliver(su_event &ev) {
     if (fork_dont_care() == 0) {
-        vector<Extra> extras;
-        extras.reserve(6);
-        extras.emplace_back("from.uid", ctx.info->uid);
-        extras.emplace_back("to.uid", ctx.req.uid);
-        extras.emplace_back("pid", ctx.pid);
-        extras.emplace_back("policy", ctx.info->access.policy);
-        extras.emplace_back("command", get_cmd(ctx.req));
-        extras.emplace_back("notify", (bool) ctx.info->access.notify);
-
-        exec_cmd("log", extras, ctx.info);
+        auto extras = ev.to_extras();
+        exec_cmd(ev.action, extras, ev.info);
         exit(0);
     }
 }
 
-void app_notify(const su_context &ctx) {
-    if (fork_dont_care() == 0) {
-        vector<Extra> extras;
-        extras.reserve(2);
-        extras.emplace_back("from.uid", ctx.info->uid);
-        extras.emplace_back("policy", ctx.info->access.policy);
+/* Other su requests can update the info at any time, events carry a private
+ * copy. It is taken on the requesting thread, as the lock can be held for as
+ * long as a prompt is on screen and must never block the notifier. */
+static shared_ptr<su_info> snapshot(const shared_ptr<su_info> &info) {
+    auto copy = make_shared<su_info>(info->uid);
+    auto lock = info->lock();
+    copy->cfg = info->cfg;
+    copy->str = info->str;
+    copy->access = info->access;
+    copy->mgr_st = info->mgr_st;
+    return copy;
+}
 
-        exec_cmd("notify", extras, ctx.info);
-        exit(0);
+// Write everything to the channel, false if the manager stopped reading
+static bool write_channel(const string &buf, size_t &off) {
+    while (off < buf.size()) {
+        ssize_t len = write(channel_fd, buf.data() + off, buf.size() - off);
+        if (len > 0) {
+            off += len;
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len == 0 || errno != EAGAIN)
+            return false;
+        pollfd pfd = { .fd = channel_fd, .events = POLLOUT };
+        if (poll(&pfd, 1, CHANNEL_WRITE_TIME) <= 0 || !(pfd.revents & POLLOUT))
+            return false;
+    }
+    return true;
+}
+
+static void deliver_events(vector<su_event> &batch) {
+    string buf;
+    // Events written to the channel, with the offset where each one ends
+    vector<pair<su_event *, size_t>> sent;
+    for (auto &ev : batch) {
+        string target = ev.info->str[SU_MANAGER] + ':' + to_string(get_user(ev.info));
+        if (channel_fd < 0)
+            open_channel(ev.info, target);
+        if (channel_fd < 0 || channel_target != target) {
+            legacy_deliver(ev);
+            continue;
+        }
+        write_entry(buf, "action", ev.action);
+        for (auto &[key, val] : ev.extras)
+            write_entry(buf, key, val);
+        write_entry(buf, "eof", "");
+        sent.emplace_back(&ev, buf.size());
+    }
+    if (buf.empty())
+        return;
+
+    // The whole batch goes out in as few writes as possible
+    size_t off = 0;
+    if (!write_channel(buf, off)) {
+        // Manager is gone or frozen, resend what it did not fully receive
+        LOGW("su: manager channel stalled\n");
+        close_channel();
+        channel_retry = time(nullptr) + CHANNEL_RETRY_TIME;
+        for (auto &[ev, end] : sent) {
+            if (end > off)
+                legacy_deliver(*ev);
+        }
+    }
+}
+
+static void *notifier_thread(void *) {
+    for (;;) {
+        vector<su_event> batch;
+        {
+            mutex_guard lock(event_lock);
+            while (events.empty()) {
+                if (channel_fd < 0) {
+                    notifier_running = false;
+                    return nullptr;
+                }
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                ts.tv_sec += CHANNEL_IDLE_TIME;
+                if (pthread_cond_timedwait(&event_cond, &event_lock, &ts) == ETIMEDOUT &&
+                    events.empty())
+                    close_channel();
+            }
+            batch.swap(events);
+        }
+        deliver_events(batch);
+    }
+}
+
+static void queue_event(su_event &&ev) {
+    mutex_guard lock(event_lock);
+    if (ev.action == "notify"sv) {
+        // Coalesce identical notifications
+        for (auto &e : events) {
+            if (e.action == ev.action && e.info->uid == ev.info->uid && e.extras == ev.extras)
+                return;
+        }
     }
+    if (events.size() >= MAX_QUEUED_EVENTS)
+        events.erase(events.begin());
+    events.push_back(std::move(ev));
+    if (notifier_running) {
+        pthread_cond_signal(&event_cond);
+    } else {
+        notifier_running = true;
+        new_daemon_thread(&notifier_thread);
+    }
+}
+
+void app_log(const su_context &ctx) {
+    su_event ev { .action = "log", .info = snapshot(ctx.info) };
+    ev.extras.reserve(6);
+    ev.extras.emplace_back("from.uid", to_string(ev.info->uid));
+    ev.extras.emplace_back("to.uid", to_string(ctx.req.uid));
+    ev.extras.emplace_back("pid", to_string(ctx.pid));
+    ev.extras.emplace_back("policy", to_string(ev.info->access.policy));
+    ev.extras.emplace_back("command", get_cmd(ctx.req));
+    ev.extras.emplace_back("notify", ev.info->access.notify ? "1" : "0");
+    queue_event(std::move(ev));
+}
+
+void app_notify(const su_context &ctx) {
+    su_event ev { .action = "notify", .info = snapshot(ctx.info) };
+    ev.extras.reserve(2);
+    ev.extras.emplace_back("from.uid", to_string(ev.info->uid));
+    ev.extras.emplace_back("policy", to_string(ev.info->access.policy));
+    queue_event(std::move(ev));
 }
 
 int app_request(const shared_ptr<su_info> &info) {
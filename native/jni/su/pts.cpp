@@ -12,57 +12,129 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <termios.h>
+#include <poll.h>
+
+#include <vector>
+#include <algorithm>
 
 #include <utils.hpp>
 
 #include "pts.hpp"
 
 /**
- * Helper functions
+ * Data pump
+ *
+ * Both directions are served by a single poll loop. Data is moved with
+ * splice through an intermediate pipe so it never enters user space.
+ * Terminals do not support splice on newer kernels, in which case the
+ * direction falls back to read/write with a buffer that grows while reads
+ * keep filling it up.
  */
-// Ensures all the data is written out
-static int write_blocking(int fd, char *buf, ssize_t bufsz) {
-    ssize_t ret, written;
-
-    written = 0;
-    do {
-        ret = write(fd, buf + written, bufsz - written);
-        if (ret == -1) return -1;
-        written += ret;
-    } while (written < bufsz);
+#define PUMP_MIN_BUF 4096
+#define PUMP_MAX_BUF 65536  /* Default pipe capacity */
+
+struct pump_dir {
+    int in;
+    int out;
+    bool use_splice = true;
+    bool eof = false;
+    int pipe[2] = { -1, -1 };
+    size_t cap = PUMP_MIN_BUF;
+    size_t pending = 0;
+    size_t off = 0;
+    std::vector<char> buf;
+
+    pump_dir(int in, int out) : in(in), out(out) {
+        if (pipe2(pipe, O_CLOEXEC | O_NONBLOCK) < 0)
+            use_splice = false;
+    }
+    ~pump_dir() {
+        if (pipe[0] >= 0) {
+            close(pipe[0]);
+            close(pipe[1]);
+        }
+    }
 
-    return 0;
-}
+    void grow() {
+        if (cap < PUMP_MAX_BUF)
+            cap *= 2;
+    }
 
-/**
- * Pump data from input FD to output FD. If close_output is
- * true, then close the output FD when we're done.
- */
-static void pump(int input, int output, bool close_output = true) {
-    char buf[4096];
-    int len;
-    while ((len = read(input, buf, 4096)) > 0) {
-        if (write_blocking(output, buf, len) == -1) break;
+    // Returns false when the input is done
+    bool fill() {
+        ssize_t len;
+        if (use_splice) {
+            len = splice(in, nullptr, pipe[1], nullptr, cap, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len < 0 && errno == EINVAL) {
+                // Not supported by either end, pipe is still empty
+                use_splice = false;
+                cap = PUMP_MIN_BUF;
+                return fill();
+            }
+        } else {
+            if (buf.size() < cap)
+                buf.resize(cap);
+            len = read(in, buf.data(), cap);
+            off = 0;
+        }
+        if (len < 0)
+            return errno == EAGAIN || errno == EINTR;
+        if (len == 0)
+            return false;
+        pending = len;
+        if (pending == cap)
+            grow();
+        return true;
     }
-    close(input);
-    if (close_output) close(output);
-}
 
-static void* pump_thread(void* data) {
-    int *fds = (int*) data;
-    pump(fds[0], fds[1]);
-    delete[] fds;
-    return nullptr;
-}
+    // Returns false when the output is broken
+    bool flush() {
+        ssize_t len;
+        if (use_splice) {
+            len = splice(pipe[0], nullptr, out, nullptr, pending, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (len < 0 && errno == EINVAL) {
+                // Output does not support splice, move what is in the pipe to the buffer
+                use_splice = false;
+                buf.resize(std::max(cap, pending));
+                if (read(pipe[0], buf.data(), pending) != (ssize_t) pending)
+                    return false;
+                off = 0;
+                return flush();
+            }
+        } else {
+            len = write(out, buf.data() + off, pending);
+        }
+        if (len < 0)
+            return errno == EAGAIN || errno == EINTR;
+        pending -= len;
+        off += len;
+        return true;
+    }
 
-static void pump_async(int input, int output) {
-    pthread_t writer;
-    int *fds = new int[2];
-    fds[0] = input;
-    fds[1] = output;
-    pthread_create(&writer, nullptr, pump_thread, fds);
-}
+    void add_poll(pollfd *pfd) const {
+        if (pending) {
+            *pfd = { out, POLLOUT, 0 };
+        } else if (!eof) {
+            *pfd = { in, POLLIN, 0 };
+        } else {
+            *pfd = { -1, 0, 0 };
+        }
+    }
 
+    // Returns false when the direction is finished
+    bool handle(const pollfd &pfd) {
+        if (pfd.revents & POLLNVAL)
+            return false;
+        if (pending) {
+            if (pfd.revents & (POLLOUT | POLLERR | POLLHUP))
+                return flush();
+        } else if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            if (!fill())
+                eof = true;
+        }
+        return !eof || pending;
+    }
+};
 
 /**
  * pts_open
@@ -256,30 +328,42 @@ int watch_sigwinch_async(int master, int slave) {
 }
 
 /**
- * pump_stdin_async
+ * pump_pts
  *
- * Forward data from STDIN to the given FD
- * in a seperate thread
+ * Forward data from STDIN to the PTY master and from
+ * the PTY master to STDOUT on the calling thread.
+ * Returns when the PTY master closes. When STDIN closes first,
+ * only the output keeps being forwarded.
+ *
+ * Before returning, restores stdin settings.
  */
-void pump_stdin_async(int outfd) {
+void pump_pts(int ptmx) {
     // Put stdin into raw mode
     set_stdin_raw();
 
-    // Pump data from stdin to the PTY
-    pump_async(STDIN_FILENO, outfd);
-}
-
-/**
- * pump_stdout_blocking
- *
- * Forward data from the FD to STDOUT.
- * Returns when the remote end of the FD closes.
- *
- * Before returning, restores stdin settings.
- */
-void pump_stdout_blocking(int infd) {
-    // Pump data from stdout to PTY
-    pump(infd, STDOUT_FILENO, false /* Don't close output when done */);
+    // Never block on the PTY, the other direction has to keep flowing
+    fcntl(ptmx, F_SETFL, fcntl(ptmx, F_GETFL) | O_NONBLOCK);
+
+    pump_dir dirs[] = { { STDIN_FILENO, ptmx }, { ptmx, STDOUT_FILENO } };
+    pollfd pfds[2];
+    bool in_done = false;
+    for (;;) {
+        if (in_done)
+            pfds[0] = { -1, 0, 0 };
+        else
+            dirs[0].add_poll(&pfds[0]);
+        dirs[1].add_poll(&pfds[1]);
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // Input may end first (e.g. a pipe), pending output still has to be drained
+        if (!in_done && !dirs[0].handle(pfds[0]))
+            in_done = true;
+        if (!dirs[1].handle(pfds[1]))
+            break;
+    }
 
     // Cleanup
     restore_stdin();
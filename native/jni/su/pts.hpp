@@ -79,21 +79,14 @@ int restore_stdin(void);
 int watch_sigwinch_async(int master, int slave);
 
 /**
- * pump_stdin_async
+ * pump_pts
  *
- * Forward data from STDIN to the given FD
- * in a seperate thread
- */
-void pump_stdin_async(int outfd);
-
-/**
- * pump_stdout_blocking
- *
- * Forward data from the FD to STDOUT.
- * Returns when the remote end of the FD closes.
+ * Forward data from STDIN to the PTY master and from
+ * the PTY master to STDOUT on the calling thread.
+ * Returns when either end closes.
  *
  * Before returning, restores stdin settings.
  */
-void pump_stdout_blocking(int infd);
+void pump_pts(int ptmx);
 
 #endif
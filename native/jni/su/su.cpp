@@ -12,6 +12,8 @@
 #include <sched.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <vector>
+#include <algorithm>
 
 #include <magisk.hpp>
 #include <daemon.hpp>
@@ -39,7 +41,11 @@ static void usage(int status) {
     "  -v, --version                 display version number and exit\n"
     "  -V                            display version code and exit\n"
     "  -mm, -M,\n"
-    "  --mount-master                force run in the global mount namespace\n");
+    "  --mount-master                force run in the global mount namespace\n"
+    "  --direct                      run without a terminal and without the\n"
+    "                                caller's environment for lower latency\n"
+    "  --bench COUNT                 run COMMAND as a direct request COUNT times\n"
+    "                                and report the request latency\n");
     exit(status);
 }
 
@@ -75,6 +81,61 @@ static void setup_sighandlers(void (*handler)(int)) {
     }
 }
 
+// Returns false if the daemon denied the request, otherwise code is the exit status
+static bool run_direct(const su_request &req, int in, int out, int err, int &code) {
+    int fd = connect_daemon();
+    write_int(fd, SUPERUSER);
+    xwrite(fd, &req, sizeof(su_req_base));
+    write_string(fd, req.shell);
+    write_string(fd, req.command);
+
+    // The daemon does not negotiate a terminal, send the streams right away
+    send_fd(fd, in);
+    send_fd(fd, out);
+    send_fd(fd, err);
+
+    if (read_int(fd)) {
+        close(fd);
+        fprintf(stderr, "%s\n", strerror(EACCES));
+        return false;
+    }
+    code = read_int(fd);
+    close(fd);
+    return true;
+}
+
+static int run_bench(su_request &req, int count) {
+    if (req.command.empty())
+        req.command = "true";
+    int null = xopen("/dev/null", O_RDWR | O_CLOEXEC);
+    std::vector<int64_t> lat;
+    lat.reserve(count);
+    for (int i = 0; i < count; ++i) {
+        timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        int code;
+        bool allowed = run_direct(req, null, null, null, code);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        if (!allowed)
+            return EACCES;
+        lat.push_back((end.tv_sec - begin.tv_sec) * 1000000LL + (end.tv_nsec - begin.tv_nsec) / 1000);
+    }
+    close(null);
+
+    int64_t total = 0;
+    for (auto us : lat)
+        total += us;
+    std::sort(lat.begin(), lat.end());
+    auto ms = [](int64_t us) { return us / 1000.0; };
+    printf("requests: %d\n", count);
+    printf("min: %.3f ms\n", ms(lat.front()));
+    printf("avg: %.3f ms\n", ms(total / count));
+    printf("p50: %.3f ms\n", ms(lat[count / 2]));
+    printf("p99: %.3f ms\n", ms(lat[count * 99 / 100]));
+    printf("max: %.3f ms\n", ms(lat.back()));
+    return EXIT_SUCCESS;
+}
+
 int su_client_main(int argc, char *argv[]) {
     int c;
     struct option long_opts[] = {
@@ -86,10 +147,13 @@ int su_client_main(int argc, char *argv[]) {
             { "version",                no_argument,        nullptr, 'v' },
             { "context",                required_argument,  nullptr, 'z' },
             { "mount-master",           no_argument,        nullptr, 'M' },
+            { "direct",                 no_argument,        nullptr, 'D' },
+            { "bench",                  required_argument,  nullptr, 'B' },
             { nullptr, 0, nullptr, 0 },
     };
 
     su_request su_req;
+    int bench = 0;
 
     for (int i = 0; i < argc; i++) {
         // Replace -cn with -z, -mm with -M for supporting getopt_long
@@ -134,6 +198,13 @@ int su_client_main(int argc, char *argv[]) {
             case 'M':
                 su_req.mount_master = true;
                 break;
+            case 'D':
+                su_req.direct = true;
+                break;
+            case 'B':
+                bench = parse_int(optarg);
+                su_req.direct = true;
+                break;
             default:
                 /* Bionic getopt_long doesn't terminate its error output by newline */
                 fprintf(stderr, "\n");
@@ -156,6 +227,13 @@ int su_client_main(int argc, char *argv[]) {
         optind++;
     }
 
+    if (bench > 0)
+        return run_bench(su_req, bench);
+    if (su_req.direct) {
+        int code;
+        return run_direct(su_req, STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, code) ? code : EACCES;
+    }
+
     char pts_slave[PATH_MAX];
     int ptmx, fd;
 
@@ -203,8 +281,7 @@ int su_client_main(int argc, char *argv[]) {
     if (atty) {
         setup_sighandlers(sighandler);
         watch_sigwinch_async(STDOUT_FILENO, ptmx);
-        pump_stdin_async(ptmx);
-        pump_stdout_blocking(ptmx);
+        pump_pts(ptmx);
     }
 
     // Get the exit code
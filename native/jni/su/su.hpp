@@ -24,8 +24,10 @@ public:
     su_access access;
     struct stat mgr_st;
 
-    /* This should be guarded with global cache lock */
+    /* Time the result was decided, 0 if it must not be reused */
     long timestamp;
+    /* Policy expiration time, 0 if never expires */
+    time_t expire;
 
     su_info(unsigned uid = 0);
     ~su_info();
@@ -42,6 +44,8 @@ struct su_req_base {
     bool login = false;
     bool keepenv = false;
     bool mount_master = false;
+    /* No terminal and no environment replay, fds are sent right away */
+    bool direct = false;
 } __attribute__((packed));
 
 struct su_request : public su_req_base {
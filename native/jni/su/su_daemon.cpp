@@ -4,6 +4,10 @@
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <sys/mount.h>
+#include <sys/stat.h>
+#include <list>
+#include <vector>
+#include <algorithm>
 
 #include <daemon.hpp>
 #include <utils.hpp>
@@ -15,12 +19,16 @@
 
 using namespace std;
 
+#define SU_CACHE_SIZE 16
+
+/* Most recently used first. Entries are dropped on database writes and expire
+ * after a few seconds, results that depend on the manager are never reused. */
 static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
-static shared_ptr<su_info> cached;
+static list<shared_ptr<su_info>> su_cache;
 
 su_info::su_info(unsigned uid) :
         uid(uid), access(DEFAULT_SU_ACCESS), mgr_st({}),
-        timestamp(0), _lock(PTHREAD_MUTEX_INITIALIZER) {}
+        timestamp(0), expire(0), _lock(PTHREAD_MUTEX_INITIALIZER) {}
 
 su_info::~su_info() {
     pthread_mutex_destroy(&_lock);
@@ -31,6 +39,11 @@ mutex_guard su_info::lock() {
 }
 
 bool su_info::is_fresh() {
+    if (expire && time(nullptr) >= expire)
+        return false;
+    // Never refreshed, the result must not be reused
+    if (timestamp == 0)
+        return false;
     timespec ts;
     clock_gettime(CLOCK_MONOTONIC, &ts);
     long current = ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
@@ -43,18 +56,18 @@ void su_info::refresh() {
     timestamp = ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
 }
 
-static void database_check(const shared_ptr<su_info> &info) {
-    int uid = info->uid;
-    get_db_settings(info->cfg);
-    get_db_strings(info->str);
+void clear_su_cache() {
+    mutex_guard lock(cache_lock);
+    su_cache.clear();
+}
 
-    // Check multiuser settings
+// The uid whose policy applies under the multiuser settings, -1 if none
+static int policy_uid(const shared_ptr<su_info> &info) {
+    int uid = info->uid;
     switch (info->cfg[SU_MULTIUSER_MODE]) {
         case MULTIUSER_MODE_OWNER_ONLY:
-            if (info->uid / 100000) {
+            if (info->uid / 100000)
                 uid = -1;
-                info->access = NO_SU_ACCESS;
-            }
             break;
         case MULTIUSER_MODE_OWNER_MANAGED:
             uid = info->uid % 100000;
@@ -63,13 +76,23 @@ static void database_check(const shared_ptr<su_info> &info) {
         default:
             break;
     }
+    return uid;
+}
+
+static void database_check(const shared_ptr<su_info> &info) {
+    get_db_settings(info->cfg);
+    get_db_strings(info->str);
+
+    // Check multiuser settings
+    int uid = policy_uid(info);
+    if (uid < 0)
+        info->access = NO_SU_ACCESS;
 
     if (uid > 0)
-        get_uid_policy(info->access, uid);
+        get_uid_policy(info->access, uid, &info->expire);
 
     // We need to check our manager
-    if (info->access.log || info->access.notify)
-        validate_manager(info->str[SU_MANAGER], uid / 100000, &info->mgr_st);
+    validate_manager(info->str[SU_MANAGER], uid < 0 ? 0 : uid / 100000, &info->mgr_st);
 }
 
 static shared_ptr<su_info> get_su_info(unsigned uid) {
@@ -79,10 +102,18 @@ static shared_ptr<su_info> get_su_info(unsigned uid) {
 
     {
         mutex_guard lock(cache_lock);
-        if (!cached || cached->uid != uid || !cached->is_fresh())
-            cached = make_shared<su_info>(uid);
-        cached->refresh();
-        info = cached;
+        auto it = find_if(su_cache.begin(), su_cache.end(),
+                [=](auto &i) { return i->uid == static_cast<int>(uid); });
+        if (it != su_cache.end()) {
+            if ((*it)->is_fresh())
+                info = *it;
+            su_cache.erase(it);
+        }
+        if (!info)
+            info = make_shared<su_info>(uid);
+        su_cache.push_front(info);
+        if (su_cache.size() > SU_CACHE_SIZE)
+            su_cache.pop_back();
     }
 
     mutex_guard lock = info->lock();
@@ -92,7 +123,13 @@ static shared_ptr<su_info> get_su_info(unsigned uid) {
         database_check(info);
 
         // If it's root or the manager, allow it silently
-        if (info->uid == UID_ROOT || (info->uid % 100000) == (info->mgr_st.st_uid % 100000)) {
+        if (info->uid == UID_ROOT) {
+            info->access = SILENT_SU_ACCESS;
+            info->refresh();
+            return info;
+        }
+        // The manager can be reinstalled under another uid at any time, do not cache
+        if (info->mgr_st.st_uid && (info->uid % 100000) == (info->mgr_st.st_uid % 100000)) {
             info->access = SILENT_SU_ACCESS;
             return info;
         }
@@ -120,19 +157,26 @@ static shared_ptr<su_info> get_su_info(unsigned uid) {
                 break;
         }
 
-        if (info->access.policy != QUERY)
+        if (info->access.policy != QUERY) {
+            // Decided by the database alone
+            info->refresh();
             return info;
+        }
 
-        // If still not determined, check if manager exists
+        // If still not determined, check if manager exists. This depends on
+        // the manager being installed, do not cache.
         if (info->str[SU_MANAGER].empty()) {
             info->access = NO_SU_ACCESS;
             return info;
         }
     } else {
+        // Cached, but the manager could have changed since
+        int uid = policy_uid(info);
+        validate_manager(info->str[SU_MANAGER], uid < 0 ? 0 : uid / 100000, &info->mgr_st);
         return info;
     }
 
-    // If still not determined, ask manager
+    // If still not determined, ask manager. The answer is never reused.
     int fd = app_request(info);
     if (fd < 0) {
         info->access.policy = DENY;
@@ -158,6 +202,217 @@ static void set_identity(unsigned uid) {
     }
 }
 
+static void switch_namespace(const su_context &ctx) {
+    int mode = ctx.req.mount_master ? NAMESPACE_MODE_GLOBAL : ctx.info->cfg[SU_MNT_NS];
+    switch (mode) {
+        case NAMESPACE_MODE_GLOBAL:
+            LOGD("su: use global namespace\n");
+            break;
+        case NAMESPACE_MODE_REQUESTER:
+            LOGD("su: use namespace of pid=[%d]\n", ctx.pid);
+            if (switch_mnt_ns(ctx.pid))
+                LOGD("su: setns failed, fallback to global\n");
+            break;
+        case NAMESPACE_MODE_ISOLATE:
+            LOGD("su: use new isolated namespace\n");
+            switch_mnt_ns(ctx.pid);
+            xunshare(CLONE_NEWNS);
+            xmount(nullptr, "/", nullptr, MS_PRIVATE | MS_REC, nullptr);
+            break;
+    }
+}
+
+static void set_user_env(const su_request &req) {
+    struct passwd *pw;
+    pw = getpwuid(req.uid);
+    if (pw) {
+        setenv("HOME", pw->pw_dir, 1);
+        setenv("USER", pw->pw_name, 1);
+        setenv("LOGNAME", pw->pw_name, 1);
+        setenv("SHELL", req.shell.data(), 1);
+    }
+}
+
+// Builtins and reserved words of sh, which only the shell can run
+static bool is_shell_word(string_view word) {
+    static const char * const words[] = {
+        "!", "{", "}", "[", "[[", ".", ":", "alias", "bg", "break", "builtin", "case",
+        "cd", "command", "continue", "do", "done", "echo", "elif", "else", "esac",
+        "eval", "exec", "exit", "export", "false", "fc", "fg", "fi", "for",
+        "function", "getopts", "hash", "if", "in", "jobs", "kill", "let", "local",
+        "print", "printf", "pwd", "read", "readonly", "return", "select", "set",
+        "shift", "source", "test", "then", "time", "times", "trap", "true", "type",
+        "typeset", "ulimit", "umask", "unalias", "unset", "until", "wait", "whence",
+        "while", nullptr
+    };
+    for (int i = 0; words[i]; ++i) {
+        if (word == words[i])
+            return true;
+    }
+    return false;
+}
+
+// Resolve an executable like execvp(), the result can be passed to execve()
+static bool find_exec(const string &name, string &path) {
+    struct stat st;
+    if (name.find('/') != string::npos) {
+        path = name;
+        return access(path.data(), X_OK) == 0 && stat(path.data(), &st) == 0 && S_ISREG(st.st_mode);
+    }
+    const char *env = getenv("PATH");
+    string_view dirs = env ? env : "/system/bin:/system/xbin";
+    for (size_t pos = 0; pos <= dirs.size();) {
+        size_t end = dirs.find(':', pos);
+        if (end == string_view::npos)
+            end = dirs.size();
+        path = end > pos ? string(dirs.substr(pos, end - pos)) : ".";
+        path += '/';
+        path += name;
+        if (access(path.data(), X_OK) == 0 && stat(path.data(), &st) == 0 && S_ISREG(st.st_mode))
+            return true;
+        pos = end + 1;
+    }
+    return false;
+}
+
+/* Commands without any shell syntax whose first word is an executable in
+ * PATH can be executed without the shell. Builtins always go to the shell. */
+static bool split_command(const string &cmd, vector<string> &args, string &path) {
+    for (char c : cmd) {
+        if (!isalnum(c) && !strchr(" _-+.,:/@%", c))
+            return false;
+    }
+    for (size_t pos = 0; pos < cmd.size();) {
+        size_t end = cmd.find(' ', pos);
+        if (end == string::npos)
+            end = cmd.size();
+        if (end > pos)
+            args.emplace_back(cmd, pos, end - pos);
+        pos = end + 1;
+    }
+    return !args.empty() && !is_shell_word(args[0]) && find_exec(args[0], path);
+}
+
+/*
+ * Direct requests run a command with the client's stdio fds as they are: no
+ * session, no terminal, no relabeling of the streams and the daemon's own
+ * environment instead of the caller's. The handler forks a single child that
+ * executes the command itself, skipping the shell when no shell syntax is used.
+ * Everything that may allocate or lock is prepared before the fork, as the
+ * daemon is multi-threaded: the child only issues plain syscalls.
+ */
+static void su_direct_handler(int client, su_context &ctx) {
+    int fds[3];
+    for (int &fd : fds)
+        fd = recv_fd(client);
+
+    // Command line
+    string shell;
+    if (!find_exec(ctx.req.shell, shell))
+        shell = "/system/bin/sh";
+    vector<string> args;
+    string path;
+    if (ctx.req.command.empty() || !split_command(ctx.req.command, args, path))
+        args.clear();
+    vector<string> sh_args = { ctx.req.shell };
+    if (!ctx.req.command.empty()) {
+        sh_args.emplace_back("-c");
+        sh_args.push_back(ctx.req.command);
+    }
+    auto to_argv = [](vector<string> &v) {
+        vector<char *> argv;
+        for (auto &s : v)
+            argv.push_back(s.data());
+        argv.push_back(nullptr);
+        return argv;
+    };
+    auto argv = to_argv(args);
+    auto sh_argv = to_argv(sh_args);
+
+    // Environment
+    vector<string> env;
+    for (char **e = environ; *e; ++e)
+        env.emplace_back(*e);
+    if (!ctx.req.keepenv) {
+        if (struct passwd *pw = getpwuid(ctx.req.uid)) {
+            auto set = [&](string_view key, string_view val) {
+                string entry = string(key) + "=" + string(val);
+                for (auto &e : env) {
+                    if (e.compare(0, key.size() + 1, entry, 0, key.size() + 1) == 0) {
+                        e = std::move(entry);
+                        return;
+                    }
+                }
+                env.push_back(std::move(entry));
+            };
+            set("HOME", pw->pw_dir);
+            set("USER", pw->pw_name);
+            set("LOGNAME", pw->pw_name);
+            set("SHELL", ctx.req.shell);
+        }
+    }
+    auto envp = to_argv(env);
+
+    // Mount namespace
+    int mode = ctx.req.mount_master ? NAMESPACE_MODE_GLOBAL : ctx.info->cfg[SU_MNT_NS];
+    int ns = -1;
+    if (mode != NAMESPACE_MODE_GLOBAL) {
+        char mnt[32];
+        snprintf(mnt, sizeof(mnt), "/proc/%d/ns/mnt", ctx.pid);
+        ns = open(mnt, O_RDONLY | O_CLOEXEC);
+        if (ns < 0)
+            LOGD("su: cannot open namespace of pid=[%d], fallback to global\n", ctx.pid);
+    }
+    LOGD("su: direct mode=[%d] exec=[%s]\n", mode, args.empty() ? shell.data() : path.data());
+    char cwd[32];
+    snprintf(cwd, sizeof(cwd), "/proc/%d/cwd", ctx.pid);
+    string err = "Cannot execute " + (args.empty() ? ctx.req.shell : args[0]) + "\n";
+    unsigned uid = ctx.req.uid;
+
+    // ack
+    write_int(client, 0);
+
+    int child = fork();
+    if (child == 0) {
+        for (int i = 0; i < 3; ++i) {
+            if (fds[i] >= 0)
+                dup2(fds[i], i);
+        }
+        if (ns >= 0)
+            setns(ns, 0);
+        if (mode == NAMESPACE_MODE_ISOLATE) {
+            unshare(CLONE_NEWNS);
+            mount(nullptr, "/", nullptr, MS_PRIVATE | MS_REC, nullptr);
+        }
+        umask(022);
+        chdir(cwd);
+        sigset_t block_set;
+        sigemptyset(&block_set);
+        sigprocmask(SIG_SETMASK, &block_set, nullptr);
+        // Set effective uid back to root first, never run with the wrong identity
+        if (seteuid(0) || setresgid(uid, uid, uid) || setresuid(uid, uid, uid))
+            _exit(1);
+        if (!args.empty())
+            execve(path.data(), argv.data(), envp.data());
+        execve(shell.data(), sh_argv.data(), envp.data());
+        write(STDERR_FILENO, err.data(), err.size());
+        _exit(127);
+    }
+    if (ns >= 0)
+        close(ns);
+    ctx.info.reset();
+    for (int fd : fds) {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    int status, code = -1;
+    if (child > 0 && waitpid(child, &status, 0) > 0)
+        code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    write(client, &code, sizeof(code));
+    close(client);
+}
+
 void su_daemon_handler(int client, struct ucred *credential) {
     LOGD("su: request from pid=[%d], client=[%d]\n", credential->pid, client);
 
@@ -186,6 +441,11 @@ void su_daemon_handler(int client, struct ucred *credential) {
         return;
     }
 
+    if (ctx.req.direct) {
+        su_direct_handler(client, ctx);
+        return;
+    }
+
     // Fork a child root process
     //
     // The child process will need to setsid, open a pseudo-terminal
@@ -269,24 +529,7 @@ void su_daemon_handler(int client, struct ucred *credential) {
     close(client);
 
     // Handle namespaces
-    if (ctx.req.mount_master)
-        ctx.info->cfg[SU_MNT_NS] = NAMESPACE_MODE_GLOBAL;
-    switch (ctx.info->cfg[SU_MNT_NS]) {
-        case NAMESPACE_MODE_GLOBAL:
-            LOGD("su: use global namespace\n");
-            break;
-        case NAMESPACE_MODE_REQUESTER:
-            LOGD("su: use namespace of pid=[%d]\n", ctx.pid);
-            if (switch_mnt_ns(ctx.pid))
-                LOGD("su: setns failed, fallback to global\n");
-            break;
-        case NAMESPACE_MODE_ISOLATE:
-            LOGD("su: use new isolated namespace\n");
-            switch_mnt_ns(ctx.pid);
-            xunshare(CLONE_NEWNS);
-            xmount(nullptr, "/", nullptr, MS_PRIVATE | MS_REC, nullptr);
-            break;
-    }
+    switch_namespace(ctx);
 
     const char *argv[4] = { nullptr };
 
@@ -312,16 +555,8 @@ void su_daemon_handler(int client, struct ucred *credential) {
         putenv(buf + pos);
         pos += strlen(buf + pos) + 1;
     }
-    if (!ctx.req.keepenv) {
-        struct passwd *pw;
-        pw = getpwuid(ctx.req.uid);
-        if (pw) {
-            setenv("HOME", pw->pw_dir, 1);
-            setenv("USER", pw->pw_name, 1);
-            setenv("LOGNAME", pw->pw_name, 1);
-            setenv("SHELL", ctx.req.shell.data(), 1);
-        }
-    }
+    if (!ctx.req.keepenv)
+        set_user_env(ctx.req);
 
     // Unblock all signals
     sigset_t block_set;
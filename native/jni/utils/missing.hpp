@@ -2,6 +2,7 @@
 
 #include <sys/syscall.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <mntent.h>
 
 // Missing libc functions
@@ -22,6 +23,38 @@
 #define linkat        compat_linkat
 #define inotify_init1 compat_inotify_init1
 #define faccessat     compat_faccessat
+#define open_tree     compat_open_tree
+#define move_mount    compat_move_mount
+#define renameat2     compat_renameat2
+#define memfd_create  compat_memfd_create
+#define splice        compat_splice
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE     1
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+// New mount API (Linux 5.2+), syscall numbers are shared across all ABIs
+#ifndef __NR_open_tree
+#define __NR_open_tree  428
+#endif
+#ifndef __NR_move_mount
+#define __NR_move_mount 429
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC       O_CLOEXEC
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
 
 ssize_t compat_getline(char **lineptr, size_t *n, FILE *stream);
 ssize_t compat_getdelim(char **lineptr, size_t *n, int delim, FILE *stream);
@@ -66,3 +99,26 @@ static inline int compat_inotify_init1(int flags) {
 static inline int compat_faccessat(int dirfd, const char *pathname, int mode, int flags) {
     return syscall(__NR_faccessat, dirfd, pathname, mode, flags);
 }
+
+static inline int compat_open_tree(int dirfd, const char *pathname, unsigned flags) {
+    return syscall(__NR_open_tree, dirfd, pathname, flags);
+}
+
+static inline int compat_move_mount(int from_dirfd, const char *from_pathname,
+        int to_dirfd, const char *to_pathname, unsigned flags) {
+    return syscall(__NR_move_mount, from_dirfd, from_pathname, to_dirfd, to_pathname, flags);
+}
+
+static inline int compat_renameat2(int olddirfd, const char *oldpath,
+        int newdirfd, const char *newpath, unsigned flags) {
+    return syscall(__NR_renameat2, olddirfd, oldpath, newdirfd, newpath, flags);
+}
+
+static inline int compat_memfd_create(const char *name, unsigned flags) {
+    return syscall(__NR_memfd_create, name, flags);
+}
+
+static inline ssize_t compat_splice(int fd_in, loff_t *off_in, int fd_out,
+                                    loff_t *off_out, size_t len, unsigned flags) {
+    return syscall(__NR_splice, fd_in, off_in, fd_out, off_out, len, flags);
+}
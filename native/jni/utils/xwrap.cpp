@@ -8,6 +8,7 @@
 #include <sys/mman.h>
 #include <sys/sendfile.h>
 #include <sys/ptrace.h>
+#include <sys/epoll.h>
 
 #include <utils.hpp>
 
@@ -496,6 +497,22 @@ int xinotify_init1(int flags) {
     return ret;
 }
 
+int xepoll_create1(int flags) {
+    int ret = epoll_create1(flags);
+    if (ret < 0) {
+        PLOGE("epoll_create1");
+    }
+    return ret;
+}
+
+int xepoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+    int ret = epoll_ctl(epfd, op, fd, event);
+    if (ret < 0) {
+        PLOGE("epoll_ctl");
+    }
+    return ret;
+}
+
 char *xrealpath(const char *path, char *resolved_path) {
     char buf[PATH_MAX];
     char *ret = realpath(path, buf);
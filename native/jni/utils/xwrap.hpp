@@ -60,6 +60,8 @@ ssize_t xsendfile(int out_fd, int in_fd, off_t *offset, size_t count);
 pid_t xfork();
 int xpoll(struct pollfd *fds, nfds_t nfds, int timeout);
 int xinotify_init1(int flags);
+int xepoll_create1(int flags);
+int xepoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
 char *xrealpath(const char *path, char *resolved_path);
 int xmknod(const char *pathname, mode_t mode, dev_t dev);
 long xptrace(int request, pid_t pid, void *addr = nullptr, void *data = nullptr);
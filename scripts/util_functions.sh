@@ -640,6 +640,9 @@ copy_sepolicy_rules() {
     local MODNAME=${MODDIR##*/}
     mkdir -p $RULESDIR/$MODNAME
     cp -f $r $RULESDIR/$MODNAME/sepolicy.rule
+    # Pre-compile rules so they do not have to be parsed on boot
+    rm -f $RULESDIR/$MODNAME/sepolicy.rule.bin
+    magiskpolicy --compile-rules $r $RULESDIR/$MODNAME/sepolicy.rule.bin 2>/dev/null
   done
 }
 